@@ -0,0 +1,133 @@
+#!/bin/sh
+#
+# Overhead of the heartbeat on the master, by mode and precision.
+#
+# Runs bench/update.sql with pgbench once without heartbeats and then
+# for every combination of BENCH_MODES and BENCH_PRECISIONS, and writes
+# one CSV line per run:
+#
+#   mode, precision_ms, tps, latency p50/p95/p99 in ms, WAL bytes/s
+#   (all of it, pgbench included), size and dead tuples of
+#   streaming_lag_data after the run, worker CPU in percent of one core,
+#   heartbeats written
+#
+# The server is selected by the usual PG* environment variables and must
+# run on this machine for the CPU numbers. Connect as a superuser: the
+# settings are changed with ALTER SYSTEM and reset at the end.
+#
+# Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+#
+# Copyright 2014 Torsten Förtsch. This program is Free
+# Software; see the README.md file for the license conditions.
+
+set -e
+
+: ${BENCH_DURATION:=60}
+: ${BENCH_CLIENTS:=8}
+: ${BENCH_SCALE:=10}
+: ${BENCH_MODES:="table heap wal"}
+: ${BENCH_PRECISIONS:="5000 1000 100 10"}
+: ${BENCH_OUT:=bench/report.csv}
+
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+q() {
+  psql -X -q -A -t -v ON_ERROR_STOP=1 -c "$1"
+}
+
+configure() {
+  q "ALTER SYSTEM SET streaming_lag.mode = '$1'"
+  q "ALTER SYSTEM SET streaming_lag.precision = $2"
+  q "SELECT pg_reload_conf()" >/dev/null
+  sleep 1
+}
+
+restore() {
+  q "ALTER SYSTEM RESET streaming_lag.mode"
+  q "ALTER SYSTEM RESET streaming_lag.precision"
+  q "SELECT pg_reload_conf()" >/dev/null
+}
+
+# user plus system time of the streaming_lag workers in clock ticks
+worker_ticks() {
+  for pid in $(q "SELECT pid FROM pg_stat_activity
+                   WHERE backend_type = 'streaming_lag'"); do
+    [ -r /proc/$pid/stat ] || continue
+    sed 's/^.*) //' /proc/$pid/stat | awk '{print $12 + $13}'
+  done | awk '{s += $1} END {print s + 0}'
+}
+
+# p50, p95 and p99 of the latencies in a pgbench log, in ms
+percentiles() {
+  cat "$tmp"/pgbench_log.* | awk '{print $3}' | sort -n |
+    awk 'function at(p,   i) {
+           i = int(NR * p)
+           if (i < NR * p) i++
+           return v[i < 1 ? 1 : i] / 1000
+         }
+         {v[NR] = $1}
+         END {
+           if (NR == 0) print ",,"
+           else printf "%.3f,%.3f,%.3f\n", at(.50), at(.95), at(.99)
+         }'
+}
+
+run() {
+  mode=$1
+  precision=$2
+
+  configure "$mode" "$precision"
+
+  rm -f "$tmp"/pgbench_log.*
+  q "VACUUM FULL $table" >/dev/null
+  q "CHECKPOINT"
+  q "SELECT pg_stat_reset()" >/dev/null
+
+  heartbeats0=$(q "SELECT heartbeats FROM $schema.streaming_lag_worker_stats")
+  lsn0=$(q "SELECT pg_current_wal_lsn()")
+  ticks0=$(worker_ticks)
+  start=$(date +%s.%N)
+
+  (cd "$tmp" && pgbench -n -f "$script" -s "$BENCH_SCALE" \
+                        -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+                        -T "$BENCH_DURATION" -l) >"$tmp/out" 2>&1
+
+  end=$(date +%s.%N)
+  ticks1=$(worker_ticks)
+  wal=$(q "SELECT pg_current_wal_lsn() - '$lsn0'")
+  heartbeats1=$(q "SELECT heartbeats FROM $schema.streaming_lag_worker_stats")
+
+  # the statistics collector reports with a delay
+  sleep 1
+  bloat=$(q "SELECT pg_relation_size('$table') || ',' || coalesce(n_dead_tup, 0)
+               FROM pg_stat_user_tables WHERE relid = '$table'::regclass")
+
+  tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$tmp/out" | head -1)
+
+  echo "$mode,$precision,$tps,$(percentiles)," \
+       "$(echo "$wal $start $end" | awk '{printf "%.0f", $1 / ($3 - $2)}')," \
+       "$bloat," \
+       "$(echo "$ticks0 $ticks1 $start $end $hz" |
+            awk '{printf "%.2f", 100 * ($2 - $1) / $5 / ($4 - $3)}')," \
+       "$((heartbeats1 - heartbeats0))" | tr -d ' '
+}
+
+script=$(cd "$dir" && pwd)/update.sql
+hz=$(getconf CLK_TCK)
+schema=$(q "SHOW streaming_lag.schema")
+table=$schema.streaming_lag_data
+
+pgbench -i -q -s "$BENCH_SCALE" >/dev/null 2>&1
+trap 'restore; rm -rf "$tmp"' EXIT
+
+{
+  echo "mode,precision_ms,tps,latency_p50_ms,latency_p95_ms,latency_p99_ms,wal_bytes_per_second,table_bytes,dead_tuples,worker_cpu_percent,heartbeats"
+  run table 0 | sed 's/^table,/off,/'
+  for mode in $BENCH_MODES; do
+    for precision in $BENCH_PRECISIONS; do
+      run "$mode" "$precision"
+    done
+  done
+} | tee "$BENCH_OUT"
@@ -0,0 +1,4 @@
+-- one small write transaction, the unit the commit latency is measured in
+\set aid random(1, 100000 * :scale)
+\set delta random(-5000, 5000)
+UPDATE pgbench_accounts SET abalance = abalance + :delta WHERE aid = :aid;
@@ -0,0 +1,286 @@
+/*
+ * sl_clock.c
+ *
+ * Estimate of the offset between the clocks of a replica and its
+ * primary, so the lag can be measured without relying on NTP.
+ *
+ * Every message from the walsender carries its send time by the
+ * primary's clock, and the WAL receiver notes when it got it by ours.
+ * The difference is the clock offset plus the one-way network delay, so
+ * its minimum over recent messages is an upper bound of the offset that
+ * is tight when the network is quiet. The primary's worker regularly
+ * logs the round trip time to each standby, as measured by the walsender
+ * from its write_lag, in a WAL record. The one-way delay lies between 0
+ * and that round trip, which gives the estimate
+ *
+ *     offset = min(receipt - send) - rtt / 2     error = rtt / 2
+ *
+ * Samples are taken whenever a heartbeat is replayed or the offset is
+ * read, by any process, under a spinlock.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xlog.h"
+#include "common/hashfn.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "replication/walreceiver.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+/* number of receipt - send differences the minimum is taken over */
+#define SL_CLOCK_SAMPLES 64
+
+/* round trip records in a row this server must be missing from */
+#define SL_CLOCK_ABSENT 3
+
+typedef struct SlClock
+{
+  slock_t     mutex;            /* protects everything below */
+  uint64      nadded;
+  TimestampTz last_send;        /* send time of the latest sample */
+  int64       rtt;              /* microseconds, -1 if unknown */
+  bool        direct;           /* listed in a recent round trip record */
+  int         absent;           /* records in a row it was not */
+  int64       delays[SL_CLOCK_SAMPLES];
+} SlClock;
+
+static SlClock *sl_clock = NULL;
+
+Size
+sl_clock_shmem_size(void)
+{
+  return sizeof(SlClock);
+}
+
+void
+sl_clock_shmem_startup(void)
+{
+  bool found;
+
+  sl_clock = ShmemInitStruct("streaming_lag clock",
+                             sl_clock_shmem_size(),
+                             &found);
+  if (!found) {
+    SpinLockInit(&sl_clock->mutex);
+    sl_clock->nadded = 0;
+    sl_clock->last_send = 0;
+    sl_clock->rtt = -1;
+    sl_clock->direct = false;
+    sl_clock->absent = 0;
+  }
+}
+
+/*
+ * The key of a standby in the round trip records: the hash of the
+ * application_name it connects with
+ */
+uint32
+sl_clock_node_hash(const char *name)
+{
+  return hash_bytes((const unsigned char *) name, strlen(name));
+}
+
+/*
+ * streaming_lag.node_name, or else cluster_name, or NULL if neither is
+ * set
+ */
+const char *
+sl_clock_given_name(void)
+{
+  if (guc_node_name && guc_node_name[0] != '\0') return guc_node_name;
+  if (cluster_name && cluster_name[0] != '\0') return cluster_name;
+  return NULL;
+}
+
+/*
+ * The application_name of this server's WAL receiver, unless it is set
+ * in primary_conninfo
+ */
+const char *
+sl_clock_node_name(void)
+{
+  const char *name = sl_clock_given_name();
+
+  return name ? name : "walreceiver";
+}
+
+/*
+ * Take the latest message the WAL receiver got as a sample
+ */
+void
+sl_clock_sample(void)
+{
+  TimestampTz send;
+  TimestampTz receipt;
+
+  if (!sl_clock || !WalRcv) return;
+
+  SpinLockAcquire(&WalRcv->mutex);
+  send = WalRcv->lastMsgSendTime;
+  receipt = WalRcv->lastMsgReceiptTime;
+  SpinLockRelease(&WalRcv->mutex);
+
+  if (send == 0 || receipt == 0) return;
+
+  SpinLockAcquire(&sl_clock->mutex);
+  if (send != sl_clock->last_send) {
+    sl_clock->delays[sl_clock->nadded++ % SL_CLOCK_SAMPLES] = receipt - send;
+    sl_clock->last_send = send;
+  }
+  SpinLockRelease(&sl_clock->mutex);
+}
+
+/*
+ * Pick this server's round trip time from a record logged by the
+ * primary's worker
+ */
+void
+sl_clock_set_rtt(const xl_streaming_lag_rtt *xlrec)
+{
+  uint32 node = sl_clock_node_hash(sl_clock_node_name());
+  int i;
+
+  if (!sl_clock) return;
+
+  for (i = 0; i < xlrec->nentries; i++) {
+    if (xlrec->entries[i].node == node) {
+      SpinLockAcquire(&sl_clock->mutex);
+      if (xlrec->entries[i].rtt >= 0) sl_clock->rtt = xlrec->entries[i].rtt;
+      sl_clock->direct = true;
+      sl_clock->absent = 0;
+      SpinLockRelease(&sl_clock->mutex);
+      return;
+    }
+  }
+
+  /* a single miss may be a walsender restarting */
+  SpinLockAcquire(&sl_clock->mutex);
+  if (++sl_clock->absent >= SL_CLOCK_ABSENT) sl_clock->direct = false;
+  SpinLockRelease(&sl_clock->mutex);
+}
+
+/*
+ * Whether this replica streams from the primary itself, as far as the
+ * round trip records tell, which list the standbys connected to the
+ * primary by application_name. Once listed, a replica counts as direct
+ * until it is missing from SL_CLOCK_ABSENT records in a row. false on a
+ * cascading standby, on one connecting under another application_name
+ * than its node name, and until the first record is replayed.
+ */
+bool
+sl_clock_direct(void)
+{
+  bool direct;
+
+  if (!sl_clock) return false;
+
+  SpinLockAcquire(&sl_clock->mutex);
+  direct = sl_clock->direct;
+  SpinLockRelease(&sl_clock->mutex);
+
+  return direct;
+}
+
+/*
+ * The estimated offset of our clock against the primary's and its error
+ * bound, -1 if the round trip time is unknown. Returns false if there is
+ * no sample.
+ */
+bool
+sl_clock_offset(int64 *offset, int64 *error, int *samples)
+{
+  int64 delay;
+  int64 rtt;
+  int n;
+  int i;
+
+  if (!sl_clock) return false;
+
+  SpinLockAcquire(&sl_clock->mutex);
+  n = (int) Min(sl_clock->nadded, (uint64) SL_CLOCK_SAMPLES);
+  delay = n > 0 ? sl_clock->delays[0] : 0;
+  for (i = 1; i < n; i++)
+    if (sl_clock->delays[i] < delay) delay = sl_clock->delays[i];
+  rtt = sl_clock->rtt;
+  SpinLockRelease(&sl_clock->mutex);
+
+  if (n == 0) return false;
+
+  *offset = rtt >= 0 ? delay - rtt / 2 : delay;
+  *error = rtt >= 0 ? rtt / 2 : -1;
+  if (samples) *samples = n;
+  return true;
+}
+
+/*
+ * Translate a time by the primary's clock to ours, if
+ * streaming_lag.clock_correction is on and this is a replica of the
+ * primary. A cascading standby measures the offset against its
+ * upstream's clock, which would be wrong for the primary's times.
+ */
+TimestampTz
+sl_clock_correct(TimestampTz tstmp)
+{
+  int64 offset;
+  int64 error;
+
+  if (!guc_clock_correction || !RecoveryInProgress()) return tstmp;
+  if (!sl_clock_direct()) return tstmp;
+  if (!sl_clock_offset(&offset, &error, NULL)) return tstmp;
+
+  return tstmp + offset;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_clock_offset);
+
+/*
+ * Estimated offset of the local clock against the primary's, its error
+ * bound and the number of samples it is based on. The error is NULL as
+ * long as the primary has not reported the round trip time to this
+ * server, the offset NULL if there is no sample.
+ */
+Datum
+streaming_lag_clock_offset(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+  int64 offset;
+  int64 error;
+  int samples;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (RecoveryInProgress()) sl_clock_sample();
+
+  if (sl_clock_offset(&offset, &error, &samples)) {
+    values[0] = IntervalPGetDatum(sl_make_interval(offset));
+    if (error >= 0) values[1] = IntervalPGetDatum(sl_make_interval(error));
+    else nulls[1] = true;
+    values[2] = Int32GetDatum(samples);
+  } else {
+    nulls[0] = nulls[1] = true;
+    values[2] = Int32GetDatum(0);
+  }
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,230 @@
+/*
+ * sl_database.c
+ *
+ * Heartbeats per database. Besides the worker for streaming_lag.database
+ * the extension can run one for each database listed in
+ * streaming_lag.databases. Every heartbeat record carries the OID of
+ * the database it was written in, and both the worker on a primary and
+ * replay on a replica file it into a slot of a shared array, one slot
+ * per database. A slot remembers the latest heartbeat and a short
+ * history of the lag.
+ *
+ * Slots are taken on first use and kept until the server restarts.
+ * They are read and written under the database LWLock.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+/* lag samples kept per database */
+#define SL_DB_HISTORY 256
+
+typedef struct SlDatabase
+{
+  Oid         dbid;             /* InvalidOid if the slot is free */
+  TimestampTz tstmp;            /* latest heartbeat */
+  XLogRecPtr  lsn;              /* end of its record */
+  uint64      heartbeats;
+  uint64      nadded;           /* samples added to the history */
+  SlSample    history[SL_DB_HISTORY];
+} SlDatabase;
+
+typedef struct SlDatabases
+{
+  int         size;
+  SlDatabase  slots[FLEXIBLE_ARRAY_MEMBER];
+} SlDatabases;
+
+static SlDatabases *sl_databases = NULL;
+
+Size
+sl_database_shmem_size(void)
+{
+  return add_size(offsetof(SlDatabases, slots),
+                  mul_size(sizeof(SlDatabase), guc_max_databases));
+}
+
+void
+sl_database_shmem_startup(void)
+{
+  bool found;
+  int i;
+
+  sl_databases = ShmemInitStruct("streaming_lag databases",
+                                 sl_database_shmem_size(),
+                                 &found);
+  if (!found) {
+    sl_databases->size = guc_max_databases;
+    for (i = 0; i < guc_max_databases; i++)
+      sl_databases->slots[i].dbid = InvalidOid;
+  }
+}
+
+/*
+ * Record a heartbeat of a database, seen at local time now. On a replica
+ * the implied lag goes into the history of the database.
+ */
+void
+sl_database_add(Oid dbid, TimestampTz tstmp, XLogRecPtr lsn, TimestampTz now)
+{
+  SlDatabase *slot = NULL;
+  int i;
+
+  if (!sl_databases || !OidIsValid(dbid)) return;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_DATABASES), LW_EXCLUSIVE);
+
+  for (i = 0; i < sl_databases->size; i++) {
+    SlDatabase *s = &sl_databases->slots[i];
+
+    if (s->dbid == dbid) {
+      slot = s;
+      break;
+    }
+    if (slot == NULL && s->dbid == InvalidOid) slot = s;
+  }
+
+  if (slot == NULL) {
+    LWLockRelease(sl_lwlock(SL_LWLOCK_DATABASES));
+    ereport(DEBUG1, (errmsg("streaming_lag: no free database slot for %u",
+                            dbid),
+                     errhint("Increase streaming_lag.max_databases.")));
+    return;
+  }
+
+  if (slot->dbid != dbid) {
+    slot->dbid = dbid;
+    slot->heartbeats = 0;
+    slot->nadded = 0;
+  }
+
+  slot->tstmp = tstmp;
+  slot->lsn = lsn;
+  slot->heartbeats++;
+
+  if (RecoveryInProgress()) {
+    SlSample *s = &slot->history[slot->nadded++ % SL_DB_HISTORY];
+
+    s->sample_time = now;
+    s->lag = now - sl_clock_correct(tstmp);
+  }
+
+  LWLockRelease(sl_lwlock(SL_LWLOCK_DATABASES));
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_databases);
+PG_FUNCTION_INFO_V1(streaming_lag_database_history);
+
+/*
+ * The latest heartbeat of every database that sent one and the time
+ * since then by the local clock
+ */
+Datum
+streaming_lag_databases(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  TimestampTz now = GetCurrentTimestamp();
+  SlDatabase *copy;
+  int n = 0;
+  int i;
+
+  if (!sl_databases) return (Datum) 0;
+
+  copy = (SlDatabase *) palloc(sizeof(SlDatabase) * sl_databases->size);
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_DATABASES), LW_SHARED);
+  for (i = 0; i < sl_databases->size; i++) {
+    SlDatabase *s = &sl_databases->slots[i];
+
+    if (s->dbid == InvalidOid) continue;
+    copy[n].dbid = s->dbid;
+    copy[n].tstmp = s->tstmp;
+    copy[n].lsn = s->lsn;
+    copy[n].heartbeats = s->heartbeats;
+    n++;
+  }
+  LWLockRelease(sl_lwlock(SL_LWLOCK_DATABASES));
+
+  for (i = 0; i < n; i++) {
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+    TimestampTz tstmp = sl_clock_correct(copy[i].tstmp);
+
+    values[0] = ObjectIdGetDatum(copy[i].dbid);
+    values[1] = TimestampTzGetDatum(copy[i].tstmp);
+    values[2] = LSNGetDatum(copy[i].lsn);
+    values[3] = Int64GetDatum((int64) copy[i].heartbeats);
+    values[4] = IntervalPGetDatum(sl_make_interval(now > tstmp ? now - tstmp : 0));
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * The lag samples of a database taken in the given window, oldest first
+ */
+Datum
+streaming_lag_database_history(PG_FUNCTION_ARGS)
+{
+  Oid dbid = PG_GETARG_OID(0);
+  TimestampTz since = GetCurrentTimestamp() -
+    sl_interval_usec(PG_GETARG_INTERVAL_P(1));
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  SlSample *samples;
+  int n = 0;
+  int i;
+
+  if (!sl_databases) return (Datum) 0;
+
+  samples = (SlSample *) palloc(sizeof(SlSample) * SL_DB_HISTORY);
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_DATABASES), LW_SHARED);
+  for (i = 0; i < sl_databases->size; i++) {
+    SlDatabase *s = &sl_databases->slots[i];
+    uint64 j;
+
+    if (s->dbid != dbid) continue;
+
+    j = s->nadded > SL_DB_HISTORY ? s->nadded - SL_DB_HISTORY : 0;
+    for (; j < s->nadded; j++) {
+      SlSample *sample = &s->history[j % SL_DB_HISTORY];
+
+      if (sample->sample_time >= since) samples[n++] = *sample;
+    }
+    break;
+  }
+  LWLockRelease(sl_lwlock(SL_LWLOCK_DATABASES));
+
+  for (i = 0; i < n; i++) {
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+    values[0] = TimestampTzGetDatum(samples[i].sample_time);
+    values[1] = IntervalPGetDatum(sl_make_interval(samples[i].lag));
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
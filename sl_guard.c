@@ -0,0 +1,258 @@
+/*
+ * sl_guard.c
+ *
+ * Staleness guard for replica sessions. With streaming_lag.max_staleness
+ * set, a query on a replica lagging further behind is rejected in
+ * ExecutorStart, before it does any work, so a pooler can retry it on
+ * another replica at once.
+ *
+ * Statements that functions run while the executor is busy with another
+ * statement pass with that one. Only the executor's own nesting is
+ * counted: utility commands are not hooked, so the statements run by DO,
+ * CALL or EXPLAIN ANALYZE are checked like any other.
+ *
+ * A read-only query of the extension's views and functions, and of no
+ * other object but functions of pg_catalog, always passes, so the lag
+ * that tripped the guard can be looked at. Membership is decided by the
+ * extension's dependencies, not by schema. The statements run on behalf
+ * of such a query must pass the same test.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "access/xlog.h"
+#include "catalog/dependency.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_proc.h"
+#include "commands/extension.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "utils/elog.h"
+#include "utils/lsyscache.h"
+
+#include "streaming_lag.h"
+
+/* SQLSTATE raised for a replica lagging more than allowed */
+#define ERRCODE_STREAMING_LAG_TOO_STALE MAKE_SQLSTATE('5','5','L','A','G')
+
+static ExecutorStart_hook_type prev_executor_start = NULL;
+static ExecutorRun_hook_type prev_executor_run = NULL;
+static ExecutorFinish_hook_type prev_executor_finish = NULL;
+
+/* statements the executor is running or finishing at the moment */
+static int nesting_level = 0;
+
+/* the top-level statement passed only as a query of the extension */
+static bool exempt = false;
+
+typedef struct SlGuardContext
+{
+  Oid         ext;              /* the extension */
+  bool        member;           /* an object of the extension was seen */
+} SlGuardContext;
+
+/* a function neither of the extension nor of pg_catalog */
+static bool
+foreign_function(Oid funcid, void *context)
+{
+  SlGuardContext *ctx = (SlGuardContext *) context;
+
+  if (getExtensionOfObject(ProcedureRelationId, funcid) == ctx->ext) {
+    ctx->member = true;
+    return false;
+  }
+  return get_func_namespace(funcid) != PG_CATALOG_NAMESPACE;
+}
+
+static bool
+foreign_expr(Node *node, void *context)
+{
+  if (node == NULL) return false;
+  if (check_functions_in_node(node, foreign_function, context)) return true;
+  return expression_tree_walker(node, foreign_expr, context);
+}
+
+/* whether a plan calls a foreign function anywhere */
+static bool
+foreign_plan(Plan *plan, SlGuardContext *ctx)
+{
+  ListCell *lc;
+
+  if (plan == NULL) return false;
+
+  if (foreign_expr((Node *) plan->targetlist, ctx) ||
+      foreign_expr((Node *) plan->qual, ctx))
+    return true;
+
+  switch (nodeTag(plan)) {
+  case T_FunctionScan:
+    if (foreign_expr((Node *) ((FunctionScan *) plan)->functions, ctx))
+      return true;
+    break;
+  case T_Result:
+    if (foreign_expr(((Result *) plan)->resconstantqual, ctx))
+      return true;
+    break;
+  case T_NestLoop:
+  case T_MergeJoin:
+  case T_HashJoin:
+    if (foreign_expr((Node *) ((Join *) plan)->joinqual, ctx))
+      return true;
+    break;
+  case T_SubqueryScan:
+    if (foreign_plan(((SubqueryScan *) plan)->subplan, ctx)) return true;
+    break;
+  case T_Append:
+    foreach(lc, ((Append *) plan)->appendplans) {
+      if (foreign_plan((Plan *) lfirst(lc), ctx)) return true;
+    }
+    break;
+  case T_MergeAppend:
+    foreach(lc, ((MergeAppend *) plan)->mergeplans) {
+      if (foreign_plan((Plan *) lfirst(lc), ctx)) return true;
+    }
+    break;
+  default:
+    break;
+  }
+
+  return foreign_plan(plan->lefttree, ctx) ||
+    foreign_plan(plan->righttree, ctx);
+}
+
+/*
+ * Whether a statement reads the extension's views, tables or functions,
+ * with no help but from the functions of pg_catalog
+ */
+static bool
+monitoring_only(QueryDesc *queryDesc)
+{
+  PlannedStmt *stmt = queryDesc->plannedstmt;
+  SlGuardContext ctx;
+  ListCell *lc;
+
+  ctx.ext = get_extension_oid("streaming_lag", true);
+  ctx.member = false;
+
+  if (!OidIsValid(ctx.ext) || stmt->commandType != CMD_SELECT ||
+      stmt->hasModifyingCTE || stmt->rowMarks != NIL)
+    return false;
+
+  foreach(lc, stmt->rtable) {
+    RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+    switch (rte->rtekind) {
+    case RTE_RELATION:
+      if (getExtensionOfObject(RelationRelationId, rte->relid) != ctx.ext)
+        return false;
+      ctx.member = true;
+      break;
+    case RTE_SUBQUERY:
+    case RTE_JOIN:
+    case RTE_FUNCTION:
+    case RTE_RESULT:
+      break;
+    default:
+      return false;
+    }
+  }
+
+  if (foreign_plan(stmt->planTree, &ctx)) return false;
+  foreach(lc, stmt->subplans) {
+    if (foreign_plan((Plan *) lfirst(lc), &ctx)) return false;
+  }
+
+  return ctx.member;
+}
+
+static void
+sl_executor_start(QueryDesc *queryDesc, int eflags)
+{
+  if (nesting_level == 0) exempt = false;
+
+  if (guc_max_staleness > 0 && (nesting_level == 0 || exempt) &&
+      !(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+      !IsParallelWorker() && RecoveryInProgress()) {
+    int64 lag = 0;
+    bool known = sl_lsnmap_lag(&lag);
+    bool stale = !known || lag > (int64) guc_max_staleness * 1000;
+
+    if (stale && monitoring_only(queryDesc)) {
+      stale = false;
+      if (nesting_level == 0) exempt = true;
+    }
+
+    if (stale && !known) {
+      ereport(ERROR, (errcode(ERRCODE_STREAMING_LAG_TOO_STALE),
+                      errmsg("replica lag is unknown"),
+                      errdetail("No heartbeat has been replayed since the "
+                                "server started.")));
+    }
+    if (stale) {
+      ereport(ERROR, (errcode(ERRCODE_STREAMING_LAG_TOO_STALE),
+                      errmsg("replica is too stale"),
+                      errdetail("Lag is %.3f ms, streaming_lag.max_staleness "
+                                "is %d ms.",
+                                lag / 1000.0, guc_max_staleness)));
+    }
+  }
+
+  if (prev_executor_start) prev_executor_start(queryDesc, eflags);
+  else standard_ExecutorStart(queryDesc, eflags);
+}
+
+static void
+sl_executor_run(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+                bool execute_once)
+{
+  nesting_level++;
+  PG_TRY();
+  {
+    if (prev_executor_run)
+      prev_executor_run(queryDesc, direction, count, execute_once);
+    else standard_ExecutorRun(queryDesc, direction, count, execute_once);
+  }
+  PG_FINALLY();
+  {
+    nesting_level--;
+  }
+  PG_END_TRY();
+}
+
+static void
+sl_executor_finish(QueryDesc *queryDesc)
+{
+  nesting_level++;
+  PG_TRY();
+  {
+    if (prev_executor_finish) prev_executor_finish(queryDesc);
+    else standard_ExecutorFinish(queryDesc);
+  }
+  PG_FINALLY();
+  {
+    nesting_level--;
+  }
+  PG_END_TRY();
+}
+
+/*
+ * Install the executor hooks. Must be called from _PG_init.
+ */
+void
+sl_guard_init(void)
+{
+  prev_executor_start = ExecutorStart_hook;
+  ExecutorStart_hook = sl_executor_start;
+  prev_executor_run = ExecutorRun_hook;
+  ExecutorRun_hook = sl_executor_run;
+  prev_executor_finish = ExecutorFinish_hook;
+  ExecutorFinish_hook = sl_executor_finish;
+}
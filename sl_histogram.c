@@ -0,0 +1,245 @@
+/*
+ * sl_histogram.c
+ *
+ * Log-linear histograms in shared memory, in the spirit of HDR
+ * histograms. Values are microseconds. Up to 32us every value has a
+ * bucket of its own, above that each power of two is split into 16
+ * linear sub-buckets, so a bucket is never wider than 1/16 of its lower
+ * bound. Values from about 12 days up share the last bucket.
+ *
+ * Recording is a bucket computation and one atomic increment, which
+ * makes it cheap enough for every replayed heartbeat, probe and hop,
+ * no matter how many processes do it at the same time.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+#define SUB_BITS     4
+#define SUB_BUCKETS  (1 << SUB_BITS)
+#define MAX_EXPONENT 40         /* 2^40us, about 12.7 days */
+#define NBUCKETS     ((MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS)
+
+typedef struct SlHistogram
+{
+  pg_atomic_uint64 buckets[NBUCKETS];
+} SlHistogram;
+
+static const char *const histogram_names[SL_NHISTOGRAMS] = {
+  "lag", "upstream", "link", "flush", "sync"
+};
+
+static SlHistogram *sl_histograms = NULL;
+
+Size
+sl_histogram_shmem_size(void)
+{
+  return mul_size(sizeof(SlHistogram), SL_NHISTOGRAMS);
+}
+
+static void
+histogram_clear(SlHistogram *h)
+{
+  int i;
+
+  for (i = 0; i < NBUCKETS; i++) pg_atomic_write_u64(&h->buckets[i], 0);
+}
+
+void
+sl_histogram_shmem_startup(void)
+{
+  bool found;
+  int i;
+  int j;
+
+  sl_histograms = ShmemInitStruct("streaming_lag histograms",
+                                  sl_histogram_shmem_size(),
+                                  &found);
+  if (!found) {
+    for (i = 0; i < SL_NHISTOGRAMS; i++) {
+      SlHistogram *h = &sl_histograms[i];
+
+      for (j = 0; j < NBUCKETS; j++) pg_atomic_init_u64(&h->buckets[j], 0);
+    }
+  }
+}
+
+static inline int
+bucket_of(uint64 v)
+{
+  int e;
+
+  if (v < 2 * SUB_BUCKETS) return (int) v;
+
+  e = pg_leftmost_one_pos64(v);
+  if (e > MAX_EXPONENT) return NBUCKETS - 1;
+
+  return (e - SUB_BITS + 1) * SUB_BUCKETS +
+    (int) ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* the range [lo, hi) of values counted by a bucket */
+static void
+bucket_range(int b, uint64 *lo, uint64 *hi)
+{
+  int e;
+  uint64 m;
+
+  if (b < 2 * SUB_BUCKETS) {
+    *lo = b;
+    *hi = b + 1;
+    return;
+  }
+
+  e = b / SUB_BUCKETS + SUB_BITS - 1;
+  m = SUB_BUCKETS + b % SUB_BUCKETS;
+  *lo = m << (e - SUB_BITS);
+  *hi = (m + 1) << (e - SUB_BITS);
+}
+
+void
+sl_histogram_record(int histogram, int64 value)
+{
+  SlHistogram *h;
+  uint64 v = value > 0 ? (uint64) value : 0;
+
+  if (!sl_histograms) return;
+
+  h = &sl_histograms[histogram];
+  pg_atomic_fetch_add_u64(&h->buckets[bucket_of(v)], 1);
+}
+
+/*
+ * Approximate percentile (0 < p <= 1) of a histogram from the upper
+ * bounds of its buckets. Returns false if the histogram is empty.
+ */
+bool
+sl_histogram_percentile(int histogram, double p, int64 *value)
+{
+  SlHistogram *h;
+  uint64 counts[NBUCKETS];
+  uint64 total = 0;
+  uint64 rank;
+  uint64 seen = 0;
+  uint64 lo;
+  uint64 hi;
+  int i;
+
+  if (!sl_histograms) return false;
+
+  h = &sl_histograms[histogram];
+  for (i = 0; i < NBUCKETS; i++) {
+    counts[i] = pg_atomic_read_u64(&h->buckets[i]);
+    total += counts[i];
+  }
+  if (total == 0) return false;
+
+  /* nearest rank, as in sl_history.c */
+  rank = (uint64) ceil(p * total);
+  rank = Max(rank, 1);
+  rank = Min(rank, total);
+
+  for (i = 0; i < NBUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen >= rank) break;
+  }
+
+  bucket_range(i, &lo, &hi);
+  *value = (int64) hi;
+  return true;
+}
+
+/*
+ * Map a histogram name to its number, ERROR if there is none
+ */
+static int
+histogram_by_name(const char *name)
+{
+  int i;
+
+  for (i = 0; i < SL_NHISTOGRAMS; i++)
+    if (strcmp(name, histogram_names[i]) == 0) return i;
+
+  ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                  errmsg("unknown histogram \"%s\"", name)));
+  return -1;                    /* keep compiler quiet */
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_histogram_data);
+PG_FUNCTION_INFO_V1(streaming_lag_histogram_reset);
+
+/*
+ * The non-empty buckets of a histogram with their bounds and the
+ * cumulative fraction of all values up to the upper bound
+ */
+Datum
+streaming_lag_histogram_data(PG_FUNCTION_ARGS)
+{
+  int histogram = histogram_by_name(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  SlHistogram *h;
+  uint64 counts[NBUCKETS];
+  uint64 total = 0;
+  uint64 seen = 0;
+  int i;
+
+  if (!sl_histograms) return (Datum) 0;
+
+  h = &sl_histograms[histogram];
+  for (i = 0; i < NBUCKETS; i++) {
+    counts[i] = pg_atomic_read_u64(&h->buckets[i]);
+    total += counts[i];
+  }
+
+  for (i = 0; i < NBUCKETS; i++) {
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+    uint64 lo;
+    uint64 hi;
+
+    if (counts[i] == 0) continue;
+    seen += counts[i];
+
+    bucket_range(i, &lo, &hi);
+    values[0] = IntervalPGetDatum(sl_make_interval((int64) lo));
+    values[1] = IntervalPGetDatum(sl_make_interval((int64) hi));
+    values[2] = Int64GetDatum((int64) counts[i]);
+    values[3] = Float8GetDatum((double) seen / total);
+    if (i == NBUCKETS - 1) nulls[1] = true;
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+Datum
+streaming_lag_histogram_reset(PG_FUNCTION_ARGS)
+{
+  int histogram = histogram_by_name(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+
+  if (sl_histograms) histogram_clear(&sl_histograms[histogram]);
+
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,234 @@
+/*
+ * sl_history.c
+ *
+ * Lag history of a replica. Each replayed heartbeat adds a sample of
+ * the local time and the lag at that moment to a fixed-size ring in
+ * shared memory, so spikes between two polls of the streaming_lag view
+ * are not lost.
+ *
+ * The startup process is the only writer. Readers take the history lock
+ * in shared mode to copy the samples they need.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/htup_details.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+typedef struct SlHistory
+{
+  int         size;
+  uint64      nadded;
+  SlSample    samples[FLEXIBLE_ARRAY_MEMBER];
+} SlHistory;
+
+static SlHistory *sl_history = NULL;
+
+Size
+sl_history_shmem_size(void)
+{
+  return add_size(offsetof(SlHistory, samples),
+                  mul_size(sizeof(SlSample), guc_history_size));
+}
+
+void
+sl_history_shmem_startup(void)
+{
+  bool found;
+
+  sl_history = ShmemInitStruct("streaming_lag history",
+                               sl_history_shmem_size(),
+                               &found);
+  if (!found) {
+    sl_history->size = guc_history_size;
+    sl_history->nadded = 0;
+  }
+}
+
+void
+sl_history_add(TimestampTz sample_time, int64 lag)
+{
+  SlSample *s;
+
+  if (!sl_history || sl_history->size <= 0) return;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_HISTORY), LW_EXCLUSIVE);
+  s = &sl_history->samples[sl_history->nadded % sl_history->size];
+  s->sample_time = sample_time;
+  s->lag = lag;
+  sl_history->nadded++;
+  LWLockRelease(sl_lwlock(SL_LWLOCK_HISTORY));
+}
+
+/*
+ * Copy the samples taken at or after since, oldest first, into a
+ * palloc'd array. Returns the number of samples.
+ */
+int
+sl_history_window(TimestampTz since, SlSample **samples)
+{
+  uint64 n;
+  uint64 i;
+  int nsamples = 0;
+
+  *samples = NULL;
+  if (!sl_history || sl_history->size <= 0) return 0;
+
+  *samples = (SlSample *) palloc(sizeof(SlSample) * sl_history->size);
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_HISTORY), LW_SHARED);
+
+  n = sl_history->nadded;
+  i = n > (uint64) sl_history->size ? n - sl_history->size : 0;
+
+  for (; i < n; i++) {
+    SlSample *s = &sl_history->samples[i % sl_history->size];
+
+    if (s->sample_time >= since) (*samples)[nsamples++] = *s;
+  }
+
+  LWLockRelease(sl_lwlock(SL_LWLOCK_HISTORY));
+
+  return nsamples;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+  int64 x = *(const int64 *) a;
+  int64 y = *(const int64 *) b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* nearest-rank percentile of a sorted array */
+static int64
+percentile(const int64 *sorted, int n, double p)
+{
+  int rank = (int) ceil(p * n);
+
+  return sorted[Max(rank, 1) - 1];
+}
+
+/*
+ * Summarize the samples taken at or after since. Returns false if there
+ * are none.
+ */
+bool
+sl_history_stats(TimestampTz since, SlLagStats *stats)
+{
+  SlSample *samples;
+  int64 *lags;
+  int n;
+  int i;
+  double sum = 0;
+
+  n = sl_history_window(since, &samples);
+  if (n == 0) return false;
+
+  lags = (int64 *) palloc(sizeof(int64) * n);
+  for (i = 0; i < n; i++) {
+    lags[i] = samples[i].lag;
+    sum += lags[i];
+  }
+  qsort(lags, n, sizeof(int64), cmp_int64);
+
+  stats->samples = n;
+  stats->min = lags[0];
+  stats->avg = (int64) (sum / n);
+  stats->p50 = percentile(lags, n, 0.50);
+  stats->p95 = percentile(lags, n, 0.95);
+  stats->p99 = percentile(lags, n, 0.99);
+  stats->max = lags[n - 1];
+
+  pfree(lags);
+  pfree(samples);
+  return true;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_history);
+PG_FUNCTION_INFO_V1(streaming_lag_stats);
+
+/*
+ * The raw samples of the given window
+ */
+Datum
+streaming_lag_history(PG_FUNCTION_ARGS)
+{
+  TimestampTz since = GetCurrentTimestamp() -
+    sl_interval_usec(PG_GETARG_INTERVAL_P(0));
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  SlSample *samples;
+  int n;
+  int i;
+
+  n = sl_history_window(since, &samples);
+
+  for (i = 0; i < n; i++) {
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+    values[0] = TimestampTzGetDatum(samples[i].sample_time);
+    values[1] = IntervalPGetDatum(sl_make_interval(samples[i].lag));
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * Number of samples, min, avg, p50, p95, p99 and max lag of the given
+ * window. All NULL but the count if there is no sample.
+ */
+Datum
+streaming_lag_stats(PG_FUNCTION_ARGS)
+{
+  TimestampTz since = GetCurrentTimestamp() -
+    sl_interval_usec(PG_GETARG_INTERVAL_P(0));
+  TupleDesc tupdesc;
+  SlLagStats stats;
+  Datum values[7];
+  bool nulls[7];
+  int i;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (sl_history_stats(since, &stats)) {
+    values[0] = Int64GetDatum(stats.samples);
+    values[1] = IntervalPGetDatum(sl_make_interval(stats.min));
+    values[2] = IntervalPGetDatum(sl_make_interval(stats.avg));
+    values[3] = IntervalPGetDatum(sl_make_interval(stats.p50));
+    values[4] = IntervalPGetDatum(sl_make_interval(stats.p95));
+    values[5] = IntervalPGetDatum(sl_make_interval(stats.p99));
+    values[6] = IntervalPGetDatum(sl_make_interval(stats.max));
+    memset(nulls, 0, sizeof(nulls));
+  } else {
+    values[0] = Int64GetDatum(0);
+    nulls[0] = false;
+    for (i = 1; i < 7; i++) nulls[i] = true;
+  }
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,170 @@
+/*
+ * sl_hops.c
+ *
+ * Lag per hop with cascading replication. A standby cannot write WAL,
+ * so it cannot stamp a heartbeat on its way down the chain. What a
+ * replica does see is when its upstream server sent the WAL past a
+ * heartbeat, by the upstream's clock, from the WAL end and send time
+ * in every message to the WAL receiver. A cascading standby sends WAL
+ * as soon as it has flushed it, so that is about when the heartbeat
+ * arrived there. Every replayed heartbeat splits into
+ *
+ *     upstream = upstream send time - primary time
+ *     link     = replay time here - upstream send time
+ *
+ * On a replica of the primary itself the upstream part is only the
+ * time the walsender took to send the record. Further up a chain it is
+ * the lag of the upstream server, which that server reports as its
+ * own link and upstream parts, and so on up to the primary.
+ *
+ * The link is measured against the upstream's clock, which is what
+ * the clock offset estimate refers to, so streaming_lag.clock_correction
+ * applies to it. The upstream part compares the clocks of the primary
+ * and the upstream server and is only as good as their synchronization.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "replication/walreceiver.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+typedef struct SlHops
+{
+  slock_t     mutex;            /* protects everything below */
+  bool        valid;            /* a heartbeat has been split */
+  int64       upstream;         /* lag of the latest heartbeat upstream */
+  int64       link;             /* and from there to here */
+} SlHops;
+
+static SlHops *sl_hops = NULL;
+
+Size
+sl_hops_shmem_size(void)
+{
+  return sizeof(SlHops);
+}
+
+void
+sl_hops_shmem_startup(void)
+{
+  bool found;
+
+  sl_hops = ShmemInitStruct("streaming_lag hops",
+                            sl_hops_shmem_size(),
+                            &found);
+  if (!found) {
+    SpinLockInit(&sl_hops->mutex);
+    sl_hops->valid = false;
+    sl_hops->upstream = 0;
+    sl_hops->link = 0;
+  }
+}
+
+/*
+ * Split the lag of a heartbeat with the given timestamp, ending at lsn
+ * and replayed at local time now. The upstream anchors must have been
+ * sampled after the record was received.
+ */
+void
+sl_hops_add(TimestampTz tstmp, XLogRecPtr lsn, TimestampTz now)
+{
+  TimestampTz sent;
+  int64 upstream;
+  int64 link;
+
+  if (!sl_hops) return;
+  if (!sl_lsnmap_lookup_source(SL_ANCHOR_UPSTREAM, lsn, &sent)) return;
+
+  upstream = Max(sent - tstmp, 0);
+  link = Max(now - sl_clock_correct(sent), 0);
+
+  SpinLockAcquire(&sl_hops->mutex);
+  sl_hops->valid = true;
+  sl_hops->upstream = upstream;
+  sl_hops->link = link;
+  SpinLockRelease(&sl_hops->mutex);
+
+  sl_histogram_record(SL_HIST_UPSTREAM, upstream);
+  sl_histogram_record(SL_HIST_LINK, link);
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_hops);
+
+/*
+ * The two parts of the lag of the latest replayed heartbeat, with their
+ * medians and p99 since the histograms were reset. No rows on a primary
+ * or before the first heartbeat.
+ */
+Datum
+streaming_lag_hops(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  char upstream_name[NI_MAXHOST + 16];
+  bool valid;
+  int64 lags[2];
+  int hop;
+
+  if (!sl_hops || !RecoveryInProgress()) return (Datum) 0;
+
+  SpinLockAcquire(&sl_hops->mutex);
+  valid = sl_hops->valid;
+  lags[0] = sl_hops->upstream;
+  lags[1] = sl_hops->link;
+  SpinLockRelease(&sl_hops->mutex);
+
+  if (!valid) return (Datum) 0;
+
+  strlcpy(upstream_name, "upstream", sizeof(upstream_name));
+  if (WalRcv) {
+    SpinLockAcquire(&WalRcv->mutex);
+    if (WalRcv->sender_host[0] != '\0')
+      snprintf(upstream_name, sizeof(upstream_name), "%s:%d",
+               WalRcv->sender_host, WalRcv->sender_port);
+    SpinLockRelease(&WalRcv->mutex);
+  }
+
+  for (hop = 0; hop < 2; hop++) {
+    int histogram = hop == 0 ? SL_HIST_UPSTREAM : SL_HIST_LINK;
+    Datum values[6];
+    bool nulls[6] = {false, false, false, false, false, false};
+    int64 p;
+
+    values[0] = Int32GetDatum(hop + 1);
+    values[1] = CStringGetTextDatum(hop == 0 ? "primary" : upstream_name);
+    values[2] = CStringGetTextDatum(hop == 0 ? upstream_name
+                                    : sl_clock_node_name());
+    values[3] = IntervalPGetDatum(sl_make_interval(lags[hop]));
+
+    if (sl_histogram_percentile(histogram, 0.5, &p))
+      values[4] = IntervalPGetDatum(sl_make_interval(p));
+    else
+      nulls[4] = true;
+    if (sl_histogram_percentile(histogram, 0.99, &p))
+      values[5] = IntervalPGetDatum(sl_make_interval(p));
+    else
+      nulls[5] = true;
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * sl_lagfile.c
+ *
+ * Lag log of a replica that survives restarts. With
+ * streaming_lag.lag_file_size set, the startup process appends the
+ * time, lag and position of every replayed heartbeat to a ring file in
+ * the data directory, mapped into memory. Writing a record is a store
+ * into the mapping; the kernel writes the pages back as it sees fit, so
+ * the last seconds can be lost in a crash of the operating system but
+ * not in one of postgres.
+ *
+ * A file of the same capacity found at startup is continued, anything
+ * else is started over. The format is in sl_lagfile.h, so
+ * tools/streaming_lag_dump can read the file without a server.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+#include "sl_lagfile.h"
+
+StaticAssertDecl(sizeof(SlLagFileHeader) <= SL_LAGFILE_HEADER,
+                 "lag file header too large");
+
+/* the mapping of the writing process */
+static char *lagfile = NULL;
+static bool lagfile_failed = false;
+
+static inline SlLagFileHeader *
+header_of(char *map)
+{
+  return (SlLagFileHeader *) map;
+}
+
+static inline SlLagFileRecord *
+record_at(char *map, uint64 i)
+{
+  SlLagFileHeader *h = header_of(map);
+
+  return (SlLagFileRecord *) (map + SL_LAGFILE_HEADER) + i % h->capacity;
+}
+
+/* records that fit into streaming_lag.lag_file_size */
+static uint32
+lagfile_capacity(void)
+{
+  int64 bytes = (int64) guc_lag_file_size * 1024 - SL_LAGFILE_HEADER;
+
+  return bytes > 0 ? (uint32) (bytes / sizeof(SlLagFileRecord)) : 0;
+}
+
+/*
+ * Open and map the file for writing, starting it over unless it has
+ * the configured capacity. Complains once and gives up on failure,
+ * replay must go on.
+ */
+static bool
+lagfile_open(void)
+{
+  uint32 capacity = lagfile_capacity();
+  Size size = SL_LAGFILE_HEADER + (Size) capacity * sizeof(SlLagFileRecord);
+  SlLagFileHeader *h;
+  struct stat st;
+  int fd;
+
+  if (lagfile) return true;
+  if (lagfile_failed || capacity == 0) return false;
+
+  fd = OpenTransientFile(SL_LAGFILE_NAME, O_RDWR | O_CREAT | PG_BINARY);
+  if (fd < 0) goto fail;
+
+  if (fstat(fd, &st) < 0 ||
+      ((Size) st.st_size != size && ftruncate(fd, size) < 0)) {
+    CloseTransientFile(fd);
+    goto fail;
+  }
+
+  lagfile = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  CloseTransientFile(fd);
+  if (lagfile == MAP_FAILED) {
+    lagfile = NULL;
+    goto fail;
+  }
+
+  h = header_of(lagfile);
+  if (h->magic != SL_LAGFILE_MAGIC || h->version != SL_LAGFILE_VERSION ||
+      h->record_size != sizeof(SlLagFileRecord) || h->capacity != capacity) {
+    memset(lagfile, 0, SL_LAGFILE_HEADER);
+    h->magic = SL_LAGFILE_MAGIC;
+    h->version = SL_LAGFILE_VERSION;
+    h->record_size = sizeof(SlLagFileRecord);
+    h->capacity = capacity;
+    h->nadded = 0;
+  }
+
+  return true;
+
+fail:
+  ereport(LOG, (errcode_for_file_access(),
+                errmsg("streaming_lag: cannot map lag file \"%s\": %m",
+                       SL_LAGFILE_NAME)));
+  lagfile_failed = true;
+  return false;
+}
+
+/*
+ * Append a replayed heartbeat
+ */
+void
+sl_lagfile_add(TimestampTz sample_time, int64 lag, XLogRecPtr lsn)
+{
+  SlLagFileHeader *h;
+  SlLagFileRecord *r;
+
+  if (guc_lag_file_size <= 0 || !lagfile_open()) return;
+
+  h = header_of(lagfile);
+  r = record_at(lagfile, h->nadded);
+  r->sample_time = sample_time;
+  r->lag = lag;
+  r->lsn = lsn;
+
+  pg_write_barrier();
+  h->nadded++;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_lag_file);
+
+/*
+ * The records in the lag file taken at or after now - since, oldest
+ * first. Reads the file, so it works on a promoted server as well.
+ */
+Datum
+streaming_lag_lag_file(PG_FUNCTION_ARGS)
+{
+  TimestampTz since = GetCurrentTimestamp() -
+    sl_interval_usec(PG_GETARG_INTERVAL_P(0));
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  SlLagFileHeader *h;
+  struct stat st;
+  char *map;
+  uint64 first;
+  uint64 last;
+  uint64 i;
+  int fd;
+
+  fd = OpenTransientFile(SL_LAGFILE_NAME, O_RDONLY | PG_BINARY);
+  if (fd < 0) {
+    if (errno == ENOENT) return (Datum) 0;
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("cannot open lag file \"%s\": %m",
+                           SL_LAGFILE_NAME)));
+  }
+
+  if (fstat(fd, &st) < 0) {
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("cannot stat lag file \"%s\": %m",
+                           SL_LAGFILE_NAME)));
+  }
+  if (st.st_size < SL_LAGFILE_HEADER) {
+    CloseTransientFile(fd);
+    return (Datum) 0;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  CloseTransientFile(fd);
+  if (map == MAP_FAILED) {
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("cannot map lag file \"%s\": %m",
+                           SL_LAGFILE_NAME)));
+  }
+
+  h = header_of(map);
+  if (h->magic != SL_LAGFILE_MAGIC || h->version != SL_LAGFILE_VERSION ||
+      h->record_size != sizeof(SlLagFileRecord) || h->capacity == 0 ||
+      SL_LAGFILE_HEADER + (uint64) h->capacity * sizeof(SlLagFileRecord) >
+      (uint64) st.st_size) {
+    munmap(map, st.st_size);
+    ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+                    errmsg("\"%s\" is not a lag file", SL_LAGFILE_NAME)));
+  }
+
+  last = h->nadded;
+  pg_read_barrier();
+  first = last > h->capacity ? last - h->capacity : 0;
+
+  for (i = first; i < last; i++) {
+    SlLagFileRecord r = *record_at(map, i);
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+
+    /* skip what the writer may have overwritten while we were reading */
+    pg_read_barrier();
+    if (i + h->capacity <= h->nadded) continue;
+
+    if (r.sample_time < since) continue;
+
+    values[0] = TimestampTzGetDatum(r.sample_time);
+    values[1] = IntervalPGetDatum(sl_make_interval(r.lag));
+    values[2] = LSNGetDatum(r.lsn);
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  munmap(map, st.st_size);
+
+  return (Datum) 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * sl_lagfile.h
+ *
+ * Layout of the lag file, shared by the server and the
+ * streaming_lag_dump tool. Only fixed width types, all in the byte order
+ * of the server writing the file.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#ifndef SL_LAGFILE_H
+#define SL_LAGFILE_H
+
+#include <stdint.h>
+
+/* relative to the data directory */
+#define SL_LAGFILE_NAME    "streaming_lag.ring"
+
+#define SL_LAGFILE_MAGIC   0x534c4c47   /* "SLLG" */
+#define SL_LAGFILE_VERSION 1
+
+/* the header takes the first SL_LAGFILE_HEADER bytes, records follow */
+#define SL_LAGFILE_HEADER  64
+
+typedef struct SlLagFileHeader
+{
+  uint32_t    magic;
+  uint32_t    version;
+  uint32_t    record_size;      /* sizeof(SlLagFileRecord) */
+  uint32_t    capacity;         /* records in the ring */
+  uint64_t    nadded;           /* records written, ever */
+} SlLagFileHeader;
+
+/*
+ * One replayed heartbeat. Record i is at slot i % capacity. It is
+ * written before nadded is advanced past it, so the records from
+ * nadded - capacity + 1 up to nadded - 1 are complete even while the
+ * server writes the next one.
+ */
+typedef struct SlLagFileRecord
+{
+  int64_t     sample_time;      /* local time, microseconds since 2000 */
+  int64_t     lag;              /* microseconds */
+  uint64_t    lsn;              /* end of the heartbeat record */
+} SlLagFileRecord;
+
+#endif                          /* SL_LAGFILE_H */
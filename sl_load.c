@@ -0,0 +1,211 @@
+/*
+ * sl_load.c
+ *
+ * WAL load generator for calibrating replicas. On the primary
+ * streaming_lag_generate_load() writes WAL at a given rate for a given
+ * time, as records of a given size, a part of them full page images,
+ * while the replicas record their lag and replay rate as usual.
+ * Stepping up the rate finds the throughput a replica sustains and its
+ * lag at each load.
+ *
+ * The records are load records of our own resource manager, which
+ * replay skips, so they cost a replica the transfer, the write and the
+ * decoding. The full page images are of block 0 of streaming_lag_data,
+ * logged with the hole, and replay writes them back into the page as it
+ * does any other.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "access/xlog.h"
+#include "access/xloginsert.h"
+#include "access/xlogrecord.h"
+#include "commands/extension.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/bufmgr.h"
+#include "storage/latch.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+/* the generator catches up with its rate this often */
+#define SL_LOAD_TICK_MS 10
+
+/*
+ * most the generator falls behind its rate, e.g. after the backend was
+ * descheduled; the rest is dropped and counted as missed
+ */
+#define SL_LOAD_MAX_BACKLOG_MS 100
+
+/* largest record size accepted */
+#define SL_LOAD_MAX_RECORD (1024 * 1024)
+
+/*
+ * Log a full page image of block 0 of rel, hole included
+ */
+static XLogRecPtr
+log_fpi(Relation rel)
+{
+  Buffer buf = ReadBuffer(rel, 0);
+  XLogRecPtr lsn;
+
+  LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+  START_CRIT_SECTION();
+  MarkBufferDirty(buf);
+  lsn = log_newpage_buffer(buf, false);
+  END_CRIT_SECTION();
+
+  UnlockReleaseBuffer(buf);
+
+  return lsn;
+}
+
+/* the heartbeat table, locked against being dropped */
+static Relation
+open_data_table(void)
+{
+  Oid nsp = get_extension_schema(get_extension_oid("streaming_lag", false));
+  Oid relid = get_relname_relid("streaming_lag_data", nsp);
+  Relation rel;
+
+  if (!OidIsValid(relid)) {
+    ereport(ERROR, (errcode(ERRCODE_UNDEFINED_TABLE),
+                    errmsg("table streaming_lag_data not found")));
+  }
+
+  rel = table_open(relid, AccessShareLock);
+  if (RelationGetNumberOfBlocks(rel) == 0) {
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("table streaming_lag_data is empty")));
+  }
+
+  return rel;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_generate_load);
+
+/*
+ * Write bytes_per_second of WAL for duration, in records with
+ * record_size bytes of data of which the fraction fpi_ratio are full
+ * page images instead. Returns the numbers of records and page images,
+ * the bytes of WAL written, as far as they are ours, the bytes dropped
+ * because the generator fell more than SL_LOAD_MAX_BACKLOG_MS behind
+ * and the time it took.
+ */
+Datum
+streaming_lag_generate_load(PG_FUNCTION_ARGS)
+{
+  int64 rate = PG_GETARG_INT64(0);
+  int64 duration = sl_interval_usec(PG_GETARG_INTERVAL_P(1));
+  int32 record_size = PG_GETARG_INT32(2);
+  double fpi_ratio = PG_GETARG_FLOAT8(3);
+  TupleDesc tupdesc;
+  Datum values[5];
+  bool nulls[5] = {false, false, false, false, false};
+  Relation rel = NULL;
+  XLogRecPtr lsn = InvalidXLogRecPtr;
+  TimestampTz start;
+  TimestampTz now;
+  char *data;
+  double fpi_debt = 0;
+  int64 records = 0;
+  int64 fpis = 0;
+  int64 bytes = 0;
+  int64 missed = 0;
+  int64 record_bytes;
+  double max_backlog;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (RecoveryInProgress()) {
+    ereport(ERROR, (errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+                    errmsg("WAL load cannot be generated during recovery")));
+  }
+  if (rate <= 0) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("bytes_per_second must be positive")));
+  }
+  if (record_size < 1 || record_size > SL_LOAD_MAX_RECORD) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("record_size must be between 1 and %d",
+                           SL_LOAD_MAX_RECORD)));
+  }
+  if (!(fpi_ratio >= 0 && fpi_ratio <= 1)) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("fpi_ratio must be between 0 and 1")));
+  }
+
+  if (fpi_ratio > 0) rel = open_data_table();
+
+  data = palloc(record_size);
+  memset(data, 'x', record_size);
+  record_bytes = MAXALIGN(SizeOfXLogRecord + SizeOfXLogRecordDataHeaderLong +
+                          SizeOfStreamingLagLoad + record_size);
+  max_backlog = Max((double) rate * SL_LOAD_MAX_BACKLOG_MS / 1000,
+                    (double) Max(record_bytes, BLCKSZ));
+
+  start = GetCurrentTimestamp();
+  for (now = start; now - start < duration; now = GetCurrentTimestamp()) {
+    double due = (double) rate * (now - start) / USECS_PER_SEC - missed;
+
+    if (due - bytes > max_backlog) {
+      missed += (int64) (due - bytes - max_backlog);
+      due = bytes + max_backlog;
+    }
+
+    while (bytes < due) {
+      CHECK_FOR_INTERRUPTS();
+
+      fpi_debt += fpi_ratio;
+      if (fpi_debt >= 1) {
+        fpi_debt -= 1;
+        lsn = log_fpi(rel);
+        bytes += BLCKSZ;
+        fpis++;
+      } else {
+        lsn = sl_xlog_load(data, record_size);
+        bytes += record_bytes;
+      }
+      records++;
+    }
+
+    /* like the heartbeat, let the WAL writer send it out */
+    if (!XLogRecPtrIsInvalid(lsn)) XLogSetAsyncXactLSN(lsn);
+
+    (void) WaitLatch(MyLatch,
+                     WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                     SL_LOAD_TICK_MS,
+                     PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  if (rel) table_close(rel, AccessShareLock);
+
+  values[0] = Int64GetDatum(records);
+  values[1] = Int64GetDatum(fpis);
+  values[2] = Int64GetDatum(bytes);
+  values[3] = Int64GetDatum(missed);
+  values[4] = IntervalPGetDatum(sl_make_interval(now - start));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,207 @@
+/*
+ * sl_logical.c
+ *
+ * Lag of logical replication subscriptions. The heartbeat record and
+ * streaming_lag_data mean nothing to a subscriber. So with
+ * streaming_lag.logical on, the worker on a publisher also keeps a row
+ * per origin in streaming_lag_logical, which can be added to a
+ * publication like any table. On the subscriber a trigger, enabled
+ * ALWAYS so apply workers fire it, files every heartbeat the apply
+ * worker of a subscription writes into a slot of a shared array, one
+ * per subscription and origin.
+ *
+ * The lag of a subscription is then the time since the latest applied
+ * heartbeat, the same as the lag of a physical replica: it grows while
+ * the apply worker is behind or stalled, no matter why.
+ *
+ * Slots are taken on first use and kept until the server restarts.
+ * They are read and written under the logical LWLock.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "commands/trigger.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "replication/worker_internal.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+/* subscription and origin pairs tracked */
+#define SL_LOGICAL_SLOTS 64
+
+typedef struct SlLogical
+{
+  Oid         subid;            /* InvalidOid if the slot is free */
+  NameData    subname;
+  NameData    origin;
+  TimestampTz tstmp;            /* latest heartbeat applied */
+  TimestampTz applied;          /* local time it was applied at */
+  uint64      heartbeats;
+} SlLogical;
+
+static SlLogical *sl_logical = NULL;
+
+Size
+sl_logical_shmem_size(void)
+{
+  return mul_size(sizeof(SlLogical), SL_LOGICAL_SLOTS);
+}
+
+void
+sl_logical_shmem_startup(void)
+{
+  bool found;
+  int i;
+
+  sl_logical = ShmemInitStruct("streaming_lag logical",
+                               sl_logical_shmem_size(),
+                               &found);
+  if (!found) {
+    for (i = 0; i < SL_LOGICAL_SLOTS; i++)
+      sl_logical[i].subid = InvalidOid;
+  }
+}
+
+/*
+ * Record a heartbeat of an origin applied by the subscription's worker
+ */
+static void
+logical_add(const char *origin, TimestampTz tstmp)
+{
+  SlLogical *slot = NULL;
+  int i;
+
+  if (!sl_logical) return;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_LOGICAL), LW_EXCLUSIVE);
+
+  for (i = 0; i < SL_LOGICAL_SLOTS; i++) {
+    SlLogical *s = &sl_logical[i];
+
+    if (s->subid == MySubscription->oid &&
+        strcmp(NameStr(s->origin), origin) == 0) {
+      slot = s;
+      break;
+    }
+    if (slot == NULL && s->subid == InvalidOid) slot = s;
+  }
+
+  if (slot == NULL) {
+    LWLockRelease(sl_lwlock(SL_LWLOCK_LOGICAL));
+    ereport(DEBUG1, (errmsg("streaming_lag: no free slot for subscription %s",
+                            MySubscription->name)));
+    return;
+  }
+
+  if (slot->subid != MySubscription->oid) {
+    slot->subid = MySubscription->oid;
+    namestrcpy(&slot->subname, MySubscription->name);
+    namestrcpy(&slot->origin, origin);
+    slot->heartbeats = 0;
+  }
+
+  slot->tstmp = tstmp;
+  slot->applied = GetCurrentTimestamp();
+  slot->heartbeats++;
+
+  LWLockRelease(sl_lwlock(SL_LWLOCK_LOGICAL));
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_logical_apply);
+PG_FUNCTION_INFO_V1(streaming_lag_subscriptions);
+
+/*
+ * AFTER INSERT OR UPDATE row trigger on streaming_lag_logical. Does
+ * nothing outside of apply workers, e.g. for the publisher's own worker.
+ */
+Datum
+streaming_lag_logical_apply(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+  HeapTuple tuple;
+  TupleDesc tupdesc;
+  Datum origin;
+  Datum tstmp;
+  bool origin_null;
+  bool tstmp_null;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    elog(ERROR, "streaming_lag_logical_apply: not called by trigger manager");
+  if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
+      !TRIGGER_FIRED_AFTER(trigdata->tg_event))
+    elog(ERROR, "streaming_lag_logical_apply: must be fired after row");
+
+  tuple = TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)
+    ? trigdata->tg_newtuple : trigdata->tg_trigtuple;
+
+  if (MySubscription == NULL) return PointerGetDatum(tuple);
+
+  tupdesc = RelationGetDescr(trigdata->tg_relation);
+  origin = heap_getattr(tuple, 1, tupdesc, &origin_null);
+  tstmp = heap_getattr(tuple, 2, tupdesc, &tstmp_null);
+
+  if (!origin_null && !tstmp_null)
+    logical_add(TextDatumGetCString(origin), DatumGetTimestampTz(tstmp));
+
+  return PointerGetDatum(tuple);
+}
+
+/*
+ * The latest heartbeat every subscription applied per origin, when it
+ * did and the time since the heartbeat was written by the local clock
+ */
+Datum
+streaming_lag_subscriptions(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  TimestampTz now = GetCurrentTimestamp();
+  SlLogical *copy;
+  int n = 0;
+  int i;
+
+  if (!sl_logical) return (Datum) 0;
+
+  copy = (SlLogical *) palloc(sizeof(SlLogical) * SL_LOGICAL_SLOTS);
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_LOGICAL), LW_SHARED);
+  for (i = 0; i < SL_LOGICAL_SLOTS; i++) {
+    if (sl_logical[i].subid != InvalidOid) copy[n++] = sl_logical[i];
+  }
+  LWLockRelease(sl_lwlock(SL_LWLOCK_LOGICAL));
+
+  for (i = 0; i < n; i++) {
+    Datum values[8];
+    bool nulls[8] = {false, false, false, false, false, false, false, false};
+
+    values[0] = ObjectIdGetDatum(copy[i].subid);
+    values[1] = CStringGetTextDatum(NameStr(copy[i].subname));
+    values[2] = CStringGetTextDatum(NameStr(copy[i].origin));
+    values[3] = TimestampTzGetDatum(copy[i].tstmp);
+    values[4] = TimestampTzGetDatum(copy[i].applied);
+    values[5] = Int64GetDatum((int64) copy[i].heartbeats);
+    values[6] = IntervalPGetDatum(sl_make_interval(Max(copy[i].applied -
+                                                       copy[i].tstmp, 0)));
+    values[7] = IntervalPGetDatum(sl_make_interval(Max(now - copy[i].tstmp, 0)));
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
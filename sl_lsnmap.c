@@ -0,0 +1,476 @@
+/*
+ * sl_lsnmap.c
+ *
+ * Map from WAL positions to the primary's clock. It answers when the
+ * primary got past a given LSN, which turns any replay position into a
+ * lag with a resolution much finer than streaming_lag.precision.
+ *
+ * Anchors come from two sources, each kept in a ring ordered by LSN:
+ *
+ *  - heartbeats: the end of every heartbeat record together with its
+ *    timestamp, added by the worker on the primary and by replay on a
+ *    replica
+ *
+ *  - upstream: on a replica, the WAL end and send time the upstream
+ *    server reports with every message to the WAL receiver. They are
+ *    sampled whenever a heartbeat is replayed or the lag is read. Only
+ *    if the upstream is the primary itself is that the primary's
+ *    clock; a cascading standby reports its own send time, which is
+ *    later by the lag of that standby.
+ *
+ * A position between two anchors is interpolated linearly, from the
+ * heartbeats and, on a replica of the primary, the upstream anchors as
+ * well. A replica also knows the commit time of the latest replayed
+ * transaction, below which the estimate can never be. Looking up both
+ * the position the WAL receiver has flushed and the replay position
+ * splits a replica's lag into network and apply lag.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xlog.h"
+#include "access/xlogrecovery.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "replication/walreceiver.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+typedef struct SlAnchor
+{
+  XLogRecPtr  lsn;
+  TimestampTz tstmp;
+} SlAnchor;
+
+typedef struct SlLsnMap
+{
+  slock_t     mutex;            /* protects everything below */
+  int         size;             /* anchors per source */
+  uint64      nadded[SL_ANCHOR_NSOURCES];
+  TimeLineID  tli[SL_ANCHOR_NSOURCES];  /* of the latest anchor */
+  SlAnchor    anchors[FLEXIBLE_ARRAY_MEMBER]; /* one ring per source */
+} SlLsnMap;
+
+static SlLsnMap *sl_lsnmap = NULL;
+
+Size
+sl_lsnmap_shmem_size(void)
+{
+  return add_size(offsetof(SlLsnMap, anchors),
+                  mul_size(sizeof(SlAnchor),
+                           mul_size(guc_lsn_map_size, SL_ANCHOR_NSOURCES)));
+}
+
+void
+sl_lsnmap_shmem_startup(void)
+{
+  bool found;
+  int i;
+
+  sl_lsnmap = ShmemInitStruct("streaming_lag lsn map",
+                              sl_lsnmap_shmem_size(),
+                              &found);
+  if (!found) {
+    SpinLockInit(&sl_lsnmap->mutex);
+    sl_lsnmap->size = guc_lsn_map_size;
+    for (i = 0; i < SL_ANCHOR_NSOURCES; i++) {
+      sl_lsnmap->nadded[i] = 0;
+      sl_lsnmap->tli[i] = 0;
+    }
+  }
+}
+
+/* the ring of a source; logical index 0 is the oldest anchor */
+static inline SlAnchor *
+ring_at(int source, uint64 i)
+{
+  uint64 n = sl_lsnmap->nadded[source];
+  uint64 oldest = n > (uint64) sl_lsnmap->size ? n - sl_lsnmap->size : 0;
+
+  return &sl_lsnmap->anchors[source * sl_lsnmap->size +
+                             (oldest + i) % sl_lsnmap->size];
+}
+
+static inline uint64
+ring_count(int source)
+{
+  return Min(sl_lsnmap->nadded[source], (uint64) sl_lsnmap->size);
+}
+
+/*
+ * Add an anchor of timeline tli. Must be called with the mutex held.
+ * Within a timeline anchors must arrive in LSN order. The same LSN
+ * again only moves the time forward, which is what a primary sitting
+ * idle at that position looks like; an older one arrived late and is
+ * dropped. A new timeline starts the ring over.
+ */
+static void
+add_locked(int source, XLogRecPtr lsn, TimestampTz tstmp, TimeLineID tli)
+{
+  SlAnchor *last;
+  uint64 n;
+
+  if (tli != sl_lsnmap->tli[source]) {
+    sl_lsnmap->nadded[source] = 0;
+    sl_lsnmap->tli[source] = tli;
+  }
+
+  n = ring_count(source);
+  last = n > 0 ? ring_at(source, n - 1) : NULL;
+
+  if (last && lsn < last->lsn) return;
+
+  if (last && lsn == last->lsn) {
+    if (tstmp > last->tstmp) last->tstmp = tstmp;
+  } else {
+    sl_lsnmap->nadded[source]++;
+    last = ring_at(source, ring_count(source) - 1);
+    last->lsn = lsn;
+    last->tstmp = tstmp;
+  }
+}
+
+void
+sl_lsnmap_add(int source, XLogRecPtr lsn, TimestampTz tstmp, TimeLineID tli)
+{
+  if (!sl_lsnmap || sl_lsnmap->size <= 0 || XLogRecPtrIsInvalid(lsn)) return;
+
+  SpinLockAcquire(&sl_lsnmap->mutex);
+  add_locked(source, lsn, tstmp, tli);
+  SpinLockRelease(&sl_lsnmap->mutex);
+}
+
+/*
+ * On a replica, add what the WAL receiver last heard from upstream.
+ * The snapshot is taken under the map's mutex, so two samples cannot
+ * be added in the opposite order of taking them.
+ */
+void
+sl_lsnmap_sample_upstream(void)
+{
+  XLogRecPtr walend;
+  TimestampTz walendtime;
+  TimeLineID tli;
+
+  if (!WalRcv || !sl_lsnmap || sl_lsnmap->size <= 0) return;
+
+  SpinLockAcquire(&sl_lsnmap->mutex);
+
+  SpinLockAcquire(&WalRcv->mutex);
+  walend = WalRcv->latestWalEnd;
+  walendtime = WalRcv->latestWalEndTime;
+  tli = WalRcv->receivedTLI;
+  SpinLockRelease(&WalRcv->mutex);
+
+  if (walendtime != 0 && !XLogRecPtrIsInvalid(walend))
+    add_locked(SL_ANCHOR_UPSTREAM, walend, walendtime, tli);
+
+  SpinLockRelease(&sl_lsnmap->mutex);
+}
+
+/*
+ * Find the newest anchor of a source at or before lsn and the oldest one
+ * after it. Must be called with the mutex held.
+ */
+static void
+ring_search(int source, XLogRecPtr lsn, SlAnchor **lo, SlAnchor **hi)
+{
+  uint64 n = ring_count(source);
+  uint64 l = 0;
+  uint64 h = n;
+
+  /* find the first anchor beyond lsn */
+  while (l < h) {
+    uint64 m = l + (h - l) / 2;
+
+    if (ring_at(source, m)->lsn <= lsn) l = m + 1;
+    else h = m;
+  }
+
+  *lo = l > 0 ? ring_at(source, l - 1) : NULL;
+  *hi = l < n ? ring_at(source, l) : NULL;
+}
+
+/*
+ * Interpolate the time at lsn between the anchors around it. A missing
+ * anchor has tstmp 0.
+ */
+static bool
+interpolate(const SlAnchor *lo, const SlAnchor *hi, XLogRecPtr lsn,
+            TimestampTz *tstmp)
+{
+  if (lo->tstmp == 0) return false;
+
+  if (hi->tstmp == 0 || hi->tstmp <= lo->tstmp) {
+    *tstmp = lo->tstmp;
+  } else {
+    *tstmp = lo->tstmp + (TimestampTz)
+      ((double) (hi->tstmp - lo->tstmp) *
+       (double) (lsn - lo->lsn) / (double) (hi->lsn - lo->lsn));
+  }
+
+  return true;
+}
+
+/*
+ * sl_lsnmap_lookup with an extra anchor above every other one, NULL for
+ * none
+ */
+static bool
+lookup(XLogRecPtr lsn, const SlAnchor *top, TimestampTz *tstmp)
+{
+  SlAnchor lo = {InvalidXLogRecPtr, 0};
+  SlAnchor hi = {InvalidXLogRecPtr, 0};
+  int nsources = sl_clock_direct() ? SL_ANCHOR_NSOURCES : 1;
+  int source;
+
+  if (!sl_lsnmap) return false;
+
+  SpinLockAcquire(&sl_lsnmap->mutex);
+
+  for (source = 0; source < nsources; source++) {
+    SlAnchor *l;
+    SlAnchor *h;
+
+    ring_search(source, lsn, &l, &h);
+
+    if (l && (lo.tstmp == 0 || l->lsn > lo.lsn ||
+              (l->lsn == lo.lsn && l->tstmp > lo.tstmp)))
+      lo = *l;
+    if (h && (hi.tstmp == 0 || h->lsn < hi.lsn ||
+              (h->lsn == hi.lsn && h->tstmp < hi.tstmp)))
+      hi = *h;
+  }
+
+  SpinLockRelease(&sl_lsnmap->mutex);
+
+  if (top && hi.tstmp == 0 && top->lsn > lsn) hi = *top;
+
+  return interpolate(&lo, &hi, lsn, tstmp);
+}
+
+/*
+ * Estimate when the primary got past lsn. Returns false if lsn is older
+ * than every anchor. If lsn is beyond every anchor, the result is the
+ * latest time the primary is known not to have been past it, so a lag
+ * computed from it errs on the safe side. The upstream anchors count
+ * only if the upstream is the primary, see sl_clock_direct().
+ */
+bool
+sl_lsnmap_lookup(XLogRecPtr lsn, TimestampTz *tstmp)
+{
+  return lookup(lsn, NULL, tstmp);
+}
+
+/*
+ * Like sl_lsnmap_lookup, but from the anchors of one source only. For
+ * SL_ANCHOR_UPSTREAM that is when the upstream server had sent past
+ * lsn, by the upstream's clock.
+ */
+bool
+sl_lsnmap_lookup_source(int source, XLogRecPtr lsn, TimestampTz *tstmp)
+{
+  SlAnchor lo = {InvalidXLogRecPtr, 0};
+  SlAnchor hi = {InvalidXLogRecPtr, 0};
+  SlAnchor *l;
+  SlAnchor *h;
+
+  if (!sl_lsnmap) return false;
+
+  SpinLockAcquire(&sl_lsnmap->mutex);
+  ring_search(source, lsn, &l, &h);
+  if (l) lo = *l;
+  if (h) hi = *h;
+  SpinLockRelease(&sl_lsnmap->mutex);
+
+  return interpolate(&lo, &hi, lsn, tstmp);
+}
+
+/*
+ * Interpolated lag of this server in microseconds, split into the part
+ * the WAL receiver is behind (network) and the part replay is behind
+ * what has been received (apply). All zero on a primary. Returns false
+ * if there is not enough information.
+ */
+bool
+sl_lsnmap_lag_components(int64 *network, int64 *apply, int64 *total)
+{
+  XLogRecPtr replay;
+  XLogRecPtr flush;
+  TimestampTz replay_time;
+  TimestampTz flush_time;
+  TimestampTz xtime;
+  TimestampTz now;
+
+  if (!RecoveryInProgress()) {
+    *network = *apply = *total = 0;
+    return true;
+  }
+
+  sl_lsnmap_sample_upstream();
+
+  replay = GetXLogReplayRecPtr(NULL);
+  flush = GetWalRcvFlushRecPtr(NULL, NULL);
+
+  /* restoring from the archive, nothing is streamed */
+  if (flush < replay) flush = replay;
+
+  if (!sl_lsnmap_lookup(replay, &replay_time)) return false;
+  if (!sl_lsnmap_lookup(flush, &flush_time)) flush_time = replay_time;
+
+  /* a position past a commit cannot be older than that commit */
+  xtime = sl_xact_time();
+  if (xtime > replay_time) replay_time = xtime;
+  if (replay_time > flush_time) flush_time = replay_time;
+
+  replay_time = sl_clock_correct(replay_time);
+  flush_time = sl_clock_correct(flush_time);
+
+  now = GetCurrentTimestamp();
+  if (flush_time > now) flush_time = now;
+  if (replay_time > now) replay_time = now;
+
+  *network = now - flush_time;
+  *apply = flush_time - replay_time;
+  *total = now - replay_time;
+  return true;
+}
+
+/*
+ * Interpolated lag of this server in microseconds. Zero on a primary.
+ * Returns false if there is not enough information.
+ */
+bool
+sl_lsnmap_lag(int64 *lag)
+{
+  int64 network;
+  int64 apply;
+
+  return sl_lsnmap_lag_components(&network, &apply, lag);
+}
+
+/*
+ * How long ago this server got past lsn, in microseconds. Zero if it is
+ * not past it yet. That is the lag of a downstream server which got as
+ * far as lsn. Returns false if lsn is older than every anchor. On a
+ * primary the current insert position is an anchor at the current time,
+ * so an LSN past the latest heartbeat is interpolated up to there.
+ */
+bool
+sl_lsnmap_lsn_lag(XLogRecPtr lsn, int64 *lag)
+{
+  SlAnchor top = {InvalidXLogRecPtr, 0};
+  XLogRecPtr current;
+  TimestampTz tstmp;
+  TimestampTz now = GetCurrentTimestamp();
+
+  if (RecoveryInProgress()) {
+    sl_lsnmap_sample_upstream();
+    current = GetXLogReplayRecPtr(NULL);
+  } else {
+    current = GetXLogInsertRecPtr();
+    top.lsn = current;
+    top.tstmp = now;
+  }
+
+  if (lsn >= current) {
+    *lag = 0;
+    return true;
+  }
+
+  if (!lookup(lsn, top.tstmp != 0 ? &top : NULL, &tstmp)) return false;
+
+  tstmp = sl_clock_correct(tstmp);
+  *lag = now > tstmp ? now - tstmp : 0;
+  return true;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_lsn_time);
+PG_FUNCTION_INFO_V1(streaming_lag_lsn_lag);
+PG_FUNCTION_INFO_V1(streaming_lag_interpolated);
+PG_FUNCTION_INFO_V1(streaming_lag_components);
+
+/*
+ * When did the primary get past the given LSN? NULL if this server has
+ * no anchor old enough.
+ */
+Datum
+streaming_lag_lsn_time(PG_FUNCTION_ARGS)
+{
+  XLogRecPtr lsn = PG_GETARG_LSN(0);
+  TimestampTz tstmp;
+
+  if (RecoveryInProgress()) sl_lsnmap_sample_upstream();
+
+  if (!sl_lsnmap_lookup(lsn, &tstmp)) PG_RETURN_NULL();
+
+  PG_RETURN_TIMESTAMPTZ(tstmp);
+}
+
+/*
+ * Lag of a server that got as far as the given LSN, see
+ * sl_lsnmap_lsn_lag(). NULL if this server has no anchor old enough.
+ */
+Datum
+streaming_lag_lsn_lag(PG_FUNCTION_ARGS)
+{
+  int64 lag;
+
+  if (!sl_lsnmap_lsn_lag(PG_GETARG_LSN(0), &lag)) PG_RETURN_NULL();
+
+  PG_RETURN_INTERVAL_P(sl_make_interval(lag));
+}
+
+Datum
+streaming_lag_interpolated(PG_FUNCTION_ARGS)
+{
+  int64 lag;
+
+  if (!sl_lsnmap_lag(&lag)) PG_RETURN_NULL();
+
+  PG_RETURN_INTERVAL_P(sl_make_interval(lag));
+}
+
+/*
+ * Network, apply and total lag, see sl_lsnmap_lag_components(). All NULL
+ * if there is not enough information.
+ */
+Datum
+streaming_lag_components(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+  int64 network;
+  int64 apply;
+  int64 total;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (sl_lsnmap_lag_components(&network, &apply, &total)) {
+    values[0] = IntervalPGetDatum(sl_make_interval(network));
+    values[1] = IntervalPGetDatum(sl_make_interval(apply));
+    values[2] = IntervalPGetDatum(sl_make_interval(total));
+  } else {
+    nulls[0] = nulls[1] = nulls[2] = true;
+  }
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
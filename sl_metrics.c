@@ -0,0 +1,524 @@
+/*
+ * sl_metrics.c
+ *
+ * Optional background worker serving the lag in the Prometheus text
+ * format over HTTP and answering health checks of load balancers on a
+ * second port. It reads the extension's shared memory only, so a scrape
+ * or a check costs no backend, no transaction and no snapshot. Scrapes
+ * are served side by side on non-blocking sockets, each closed after
+ * one request; every HTTP path returns the same document.
+ *
+ * A health check connection is answered with "up" or "down" as soon as
+ * it is accepted, without reading anything, which suits both the
+ * HAProxy agent check and a plain TCP check expecting a string.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "access/xlog.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+/* how long a client may take to send its request and read the reply */
+#define SL_METRICS_IO_TIMEOUT_MS 1000
+
+/* scrapes served at a time, more wait in the listen queue */
+#define SL_METRICS_MAX_CLIENTS 16
+
+/* window of the lag history the percentiles are computed over */
+#define SL_METRICS_WINDOW (5 * USECS_PER_MINUTE)
+
+PGDLLEXPORT void sl_metrics_main(Datum main_arg);
+
+/*
+ * Open a non-blocking listening TCP socket, FATAL on failure
+ */
+static pgsocket
+open_listener(const char *address, int port)
+{
+  struct sockaddr_in addr;
+  pgsocket fd;
+  int one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    ereport(FATAL, (errmsg("%s: invalid listen address \"%s\"",
+                           MyBgworkerEntry->bgw_name, address)));
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == PGINVALID_SOCKET) {
+    ereport(FATAL, (errmsg("%s: cannot create socket: %m",
+                           MyBgworkerEntry->bgw_name)));
+  }
+
+  (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0 || !pg_set_noblock(fd)) {
+    ereport(FATAL, (errmsg("%s: cannot listen on %s:%d: %m",
+                           MyBgworkerEntry->bgw_name, address, port)));
+  }
+
+  ereport(LOG, (errmsg("%s: listening on %s:%d",
+                       MyBgworkerEntry->bgw_name, address, port)));
+  return fd;
+}
+
+/* a metric in the Prometheus text format, with its help and type */
+static void
+append_metric(StringInfo buf, const char *name, const char *type,
+              const char *help, double value)
+{
+  appendStringInfo(buf, "# HELP %s %s\n# TYPE %s %s\n%s %.6f\n",
+                   name, help, name, type, name, value);
+}
+
+/*
+ * The metrics document, built from shared memory only
+ */
+static void
+build_metrics(StringInfo buf)
+{
+  bool in_recovery = RecoveryInProgress();
+  TimestampTz now = GetCurrentTimestamp();
+  TimestampTz tstmp;
+  int64 network;
+  int64 apply;
+  int64 total;
+  int64 offset;
+  int64 error;
+  int64 p50;
+  int64 p99;
+  SlLagStats stats;
+  SlWorkerStats ws;
+
+  append_metric(buf, "streaming_lag_in_recovery", "gauge",
+                "Whether this server is a replica.", in_recovery ? 1 : 0);
+
+  if (sl_primary_time(&tstmp)) {
+    append_metric(buf, "streaming_lag_heartbeat_timestamp_seconds", "gauge",
+                  "Time of the latest heartbeat or replayed commit by the "
+                  "primary's clock.",
+                  (double) (tstmp - SetEpochTimestamp()) / USECS_PER_SEC);
+    if (in_recovery) {
+      append_metric(buf, "streaming_lag_seconds", "gauge",
+                    "Lag by the latest replayed heartbeat or commit.",
+                    (double) (now - sl_clock_correct(tstmp)) / USECS_PER_SEC);
+    }
+  }
+
+  if (sl_lsnmap_lag_components(&network, &apply, &total)) {
+    append_metric(buf, "streaming_lag_interpolated_seconds", "gauge",
+                  "Lag of the replay position.",
+                  (double) total / USECS_PER_SEC);
+    append_metric(buf, "streaming_lag_network_seconds", "gauge",
+                  "Lag of the position flushed by the WAL receiver.",
+                  (double) network / USECS_PER_SEC);
+    append_metric(buf, "streaming_lag_apply_seconds", "gauge",
+                  "How far replay is behind what has been received.",
+                  (double) apply / USECS_PER_SEC);
+  }
+
+  if (in_recovery && sl_history_stats(now - SL_METRICS_WINDOW, &stats)) {
+    appendStringInfoString(buf,
+                           "# HELP streaming_lag_history_seconds Lag at the "
+                           "heartbeats replayed in the last 5 minutes.\n"
+                           "# TYPE streaming_lag_history_seconds summary\n");
+    appendStringInfo(buf,
+                     "streaming_lag_history_seconds{quantile=\"0\"} %.6f\n"
+                     "streaming_lag_history_seconds{quantile=\"0.5\"} %.6f\n"
+                     "streaming_lag_history_seconds{quantile=\"0.95\"} %.6f\n"
+                     "streaming_lag_history_seconds{quantile=\"0.99\"} %.6f\n"
+                     "streaming_lag_history_seconds{quantile=\"1\"} %.6f\n"
+                     "streaming_lag_history_seconds_sum %.6f\n"
+                     "streaming_lag_history_seconds_count " INT64_FORMAT "\n",
+                     (double) stats.min / USECS_PER_SEC,
+                     (double) stats.p50 / USECS_PER_SEC,
+                     (double) stats.p95 / USECS_PER_SEC,
+                     (double) stats.p99 / USECS_PER_SEC,
+                     (double) stats.max / USECS_PER_SEC,
+                     (double) stats.avg * stats.samples / USECS_PER_SEC,
+                     stats.samples);
+  }
+
+  if (in_recovery && sl_clock_offset(&offset, &error, NULL)) {
+    append_metric(buf, "streaming_lag_clock_offset_seconds", "gauge",
+                  "Estimated offset of the local clock against the primary's.",
+                  (double) offset / USECS_PER_SEC);
+    if (error >= 0) {
+      append_metric(buf, "streaming_lag_clock_offset_error_seconds", "gauge",
+                    "Error bound of the clock offset estimate.",
+                    (double) error / USECS_PER_SEC);
+    }
+  }
+
+  if (!in_recovery && sl_histogram_percentile(SL_HIST_FLUSH, 0.5, &p50) &&
+      sl_histogram_percentile(SL_HIST_FLUSH, 0.99, &p99)) {
+    append_metric(buf, "streaming_lag_flush_p50_seconds", "gauge",
+                  "Median time to flush a heartbeat probe.",
+                  (double) p50 / USECS_PER_SEC);
+    append_metric(buf, "streaming_lag_flush_p99_seconds", "gauge",
+                  "99th percentile of the time to flush a heartbeat probe.",
+                  (double) p99 / USECS_PER_SEC);
+  }
+
+  if (!in_recovery && sl_histogram_percentile(SL_HIST_SYNC, 0.5, &p50) &&
+      sl_histogram_percentile(SL_HIST_SYNC, 0.99, &p99)) {
+    append_metric(buf, "streaming_lag_sync_p50_seconds", "gauge",
+                  "Median time until the synchronous standbys confirmed a "
+                  "heartbeat probe.",
+                  (double) p50 / USECS_PER_SEC);
+    append_metric(buf, "streaming_lag_sync_p99_seconds", "gauge",
+                  "99th percentile of the time until the synchronous "
+                  "standbys confirmed a heartbeat probe.",
+                  (double) p99 / USECS_PER_SEC);
+  }
+
+  sl_stats_get(&ws);
+  append_metric(buf, "streaming_lag_worker_ticks_total", "counter",
+                "Scheduler ticks of the heartbeat worker.", (double) ws.ticks);
+  append_metric(buf, "streaming_lag_worker_missed_ticks_total", "counter",
+                "Ticks coalesced into a later one.", (double) ws.missed_ticks);
+  append_metric(buf, "streaming_lag_worker_heartbeats_total", "counter",
+                "Ticks that wrote a heartbeat.", (double) ws.heartbeats);
+  append_metric(buf, "streaming_lag_worker_tick_seconds_total", "counter",
+                "Time spent writing heartbeats.",
+                (double) ws.tick_time_total / USECS_PER_SEC);
+  append_metric(buf, "streaming_lag_worker_execute_seconds_total", "counter",
+                "Time spent executing the heartbeat UPDATE.",
+                (double) ws.exec_time_total / USECS_PER_SEC);
+  append_metric(buf, "streaming_lag_worker_commit_seconds_total", "counter",
+                "Time spent committing heartbeats.",
+                (double) ws.commit_time_total / USECS_PER_SEC);
+  append_metric(buf, "streaming_lag_worker_wal_bytes_total", "counter",
+                "WAL written by heartbeats.", (double) ws.wal_bytes);
+  append_metric(buf, "streaming_lag_worker_jitter_seconds", "gauge",
+                "How late the latest tick fired.",
+                (double) ws.jitter_last / USECS_PER_SEC);
+  append_metric(buf, "streaming_lag_worker_jitter_max_seconds", "gauge",
+                "How late the latest tick fired at most.",
+                (double) ws.jitter_max / USECS_PER_SEC);
+}
+
+/*
+ * A scrape being served. The sockets are non-blocking and all clients
+ * are multiplexed in one wait, so a slow one holds up nobody else.
+ */
+typedef struct SlClient
+{
+  pgsocket    fd;               /* PGINVALID_SOCKET if the slot is free */
+  TimestampTz deadline;
+  char        req[4096];
+  size_t      len;
+  char       *reply;            /* NULL while the request is read */
+  size_t      reply_len;
+  size_t      sent;
+} SlClient;
+
+static SlClient clients[SL_METRICS_MAX_CLIENTS];
+
+static void
+close_client(SlClient *c)
+{
+  closesocket(c->fd);
+  c->fd = PGINVALID_SOCKET;
+  if (c->reply) pfree(c->reply);
+  c->reply = NULL;
+}
+
+static SlClient *
+free_client(void)
+{
+  int i;
+
+  for (i = 0; i < SL_METRICS_MAX_CLIENTS; i++) {
+    if (clients[i].fd == PGINVALID_SOCKET) return &clients[i];
+  }
+  return NULL;
+}
+
+/*
+ * Build the reply to the request read so far: the metrics, or a 405
+ * for anything but a GET. Temporary memory goes into reqcontext, the
+ * reply into TopMemoryContext.
+ */
+static void
+build_reply(SlClient *c, MemoryContext reqcontext)
+{
+  MemoryContext oldcontext = MemoryContextSwitchTo(reqcontext);
+  StringInfoData body;
+  StringInfoData head;
+
+  initStringInfo(&body);
+  initStringInfo(&head);
+
+  if (strncmp(c->req, "GET ", 4) != 0) {
+    appendStringInfoString(&body, "method not allowed\n");
+    appendStringInfoString(&head, "HTTP/1.0 405 Method Not Allowed\r\n");
+  } else {
+    build_metrics(&body);
+    appendStringInfoString(&head, "HTTP/1.0 200 OK\r\n");
+  }
+
+  appendStringInfo(&head,
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %d\r\n"
+                   "Connection: close\r\n\r\n",
+                   body.len);
+
+  c->reply_len = head.len + body.len;
+  c->reply = MemoryContextAlloc(TopMemoryContext, c->reply_len);
+  memcpy(c->reply, head.data, head.len);
+  memcpy(c->reply + head.len, body.data, body.len);
+  c->sent = 0;
+
+  MemoryContextSwitchTo(oldcontext);
+  MemoryContextReset(reqcontext);
+}
+
+/*
+ * Read what the client has sent, up to the empty line that ends the
+ * request header, then build the reply
+ */
+static void
+read_client(SlClient *c, MemoryContext reqcontext)
+{
+  while (c->len < sizeof(c->req) - 1) {
+    ssize_t n = recv(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len, 0);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) break;
+    c->len += n;
+    c->req[c->len] = '\0';
+    if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) break;
+  }
+  c->req[c->len] = '\0';
+
+  if (c->len == 0) {
+    close_client(c);
+    return;
+  }
+  build_reply(c, reqcontext);
+}
+
+/* send as much of the reply as the socket takes, close when done */
+static void
+write_client(SlClient *c)
+{
+  while (c->sent < c->reply_len) {
+    ssize_t n = send(c->fd, c->reply + c->sent, c->reply_len - c->sent, 0);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) break;
+    c->sent += n;
+  }
+  close_client(c);
+}
+
+/*
+ * Answer a health check: up if the lag is at most
+ * streaming_lag.health_max_lag, down otherwise or if it is not known.
+ * The reply always fits into the send buffer of a new connection.
+ */
+static void
+serve_health(pgsocket fd)
+{
+  char reply[64];
+  int64 lag;
+
+  if (!sl_lsnmap_lag(&lag)) {
+    snprintf(reply, sizeof(reply), "down #lag unknown\n");
+  } else {
+    snprintf(reply, sizeof(reply), "%s #lag " INT64_FORMAT "ms\n",
+             lag <= (int64) guc_health_max_lag * 1000 ? "up" : "down",
+             lag / 1000);
+  }
+
+  (void) send(fd, reply, strlen(reply), 0);
+}
+
+/*
+ * Accept all pending connections of a listening socket. Health checks
+ * are answered right away, scrapes take a free slot as long as there
+ * is one.
+ */
+static void
+accept_clients(pgsocket listener, bool health)
+{
+  for (;;) {
+    SlClient *c = health ? NULL : free_client();
+    pgsocket fd;
+
+    if (!health && c == NULL) return;
+
+    fd = accept(listener, NULL, NULL);
+    if (fd == PGINVALID_SOCKET) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ereport(LOG, (errmsg("%s: cannot accept connection: %m",
+                             MyBgworkerEntry->bgw_name)));
+      }
+      return;
+    }
+
+    /* not every platform inherits non-blocking mode from the listener */
+    (void) pg_set_noblock(fd);
+
+    if (health) {
+      serve_health(fd);
+      closesocket(fd);
+      continue;
+    }
+
+    c->fd = fd;
+    c->deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                              SL_METRICS_IO_TIMEOUT_MS);
+    c->len = 0;
+    c->reply = NULL;
+  }
+}
+
+void
+sl_metrics_main(Datum main_arg)
+{
+  MemoryContext reqcontext;
+  pgsocket metrics = PGINVALID_SOCKET;
+  pgsocket health = PGINVALID_SOCKET;
+  int i;
+
+  pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  BackgroundWorkerUnblockSignals();
+
+  if (guc_metrics_port > 0)
+    metrics = open_listener(guc_metrics_address, guc_metrics_port);
+  if (guc_health_port > 0)
+    health = open_listener(guc_metrics_address, guc_health_port);
+
+  reqcontext = AllocSetContextCreate(TopMemoryContext,
+                                     "streaming_lag metrics",
+                                     ALLOCSET_DEFAULT_SIZES);
+
+  for (i = 0; i < SL_METRICS_MAX_CLIENTS; i++)
+    clients[i].fd = PGINVALID_SOCKET;
+
+  while (!ShutdownRequestPending) {
+    WaitEventSet *set;
+    WaitEvent events[SL_METRICS_MAX_CLIENTS + 4];
+    TimestampTz now = GetCurrentTimestamp();
+    long timeout = -1;
+    int nevents;
+
+    /* the clients come and go, so the set is built for every wait */
+#if PG_VERSION_NUM >= 170000
+    set = CreateWaitEventSet(NULL, lengthof(events));
+#else
+    set = CreateWaitEventSet(TopMemoryContext, lengthof(events));
+#endif
+    AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    if (metrics != PGINVALID_SOCKET && free_client() != NULL)
+      AddWaitEventToSet(set, WL_SOCKET_READABLE, metrics, NULL, NULL);
+    if (health != PGINVALID_SOCKET)
+      AddWaitEventToSet(set, WL_SOCKET_READABLE, health, NULL, NULL);
+
+    for (i = 0; i < SL_METRICS_MAX_CLIENTS; i++) {
+      SlClient *c = &clients[i];
+      long left;
+
+      if (c->fd == PGINVALID_SOCKET) continue;
+      AddWaitEventToSet(set,
+                        c->reply ? WL_SOCKET_WRITEABLE : WL_SOCKET_READABLE,
+                        c->fd, NULL, c);
+      left = c->deadline > now ? (long) ((c->deadline - now + 999) / 1000) : 0;
+      if (timeout < 0 || left < timeout) timeout = left;
+    }
+
+    nevents = WaitEventSetWait(set, timeout, events, lengthof(events),
+                               PG_WAIT_EXTENSION);
+    FreeWaitEventSet(set);
+
+    for (i = 0; i < nevents; i++) {
+      WaitEvent *event = &events[i];
+      SlClient *c = (SlClient *) event->user_data;
+
+      if (event->events & WL_LATCH_SET) {
+        ResetLatch(MyLatch);
+      } else if (c != NULL) {
+        if (c->reply) write_client(c);
+        else read_client(c, reqcontext);
+
+        /* a complete request is answered without waiting again */
+        if (c->fd != PGINVALID_SOCKET && c->reply) write_client(c);
+      } else if (event->events & WL_SOCKET_READABLE) {
+        accept_clients(event->fd, event->fd == health);
+      }
+    }
+
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    /* drop the clients too slow to send a request or take the reply */
+    now = GetCurrentTimestamp();
+    for (i = 0; i < SL_METRICS_MAX_CLIENTS; i++) {
+      if (clients[i].fd != PGINVALID_SOCKET && clients[i].deadline <= now)
+        close_client(&clients[i]);
+    }
+  }
+
+  proc_exit(0);
+}
+
+/*
+ * Register the worker if streaming_lag.metrics_port or
+ * streaming_lag.health_port is set. Must be called from _PG_init.
+ */
+void
+sl_metrics_init(void)
+{
+  BackgroundWorker worker;
+
+  if (guc_metrics_port <= 0 && guc_health_port <= 0) return;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_ConsistentState;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "streaming_lag");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "sl_metrics_main");
+
+  worker.bgw_restart_time = 10;
+  worker.bgw_main_arg = (Datum) 0;
+
+  snprintf(worker.bgw_name, BGW_MAXLEN, "streaming_lag metrics");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "streaming_lag metrics");
+
+  RegisterBackgroundWorker(&worker);
+}
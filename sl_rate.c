@@ -0,0 +1,219 @@
+/*
+ * sl_rate.c
+ *
+ * Replay throughput of a replica and the time it needs to catch up.
+ * Between two replayed heartbeats the startup process measures how many
+ * bytes of WAL and how much of the primary's time it replayed per second
+ * of its own. Both rates are smoothed exponentially with a time constant
+ * of SL_RATE_TAU. A replica replaying s seconds of the primary's time
+ * per second shrinks its lag by s - 1 seconds per second, which gives
+ * the estimated time to catch up. There is none while s is hardly above
+ * 1, or while replay is stuck and no heartbeat has come for
+ * SL_RATE_STALE times the primary's interval between them.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/htup_details.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+#define SL_RATE_TAU (30.0 * USECS_PER_SEC)
+
+/* least speed - 1 a time to catch up is estimated from */
+#define SL_RATE_MIN_GAIN 0.01
+
+/* heartbeat intervals after which the rates are too old for an estimate */
+#define SL_RATE_STALE 3
+
+typedef struct SlRate
+{
+  slock_t     mutex;            /* protects everything below */
+  TimestampTz last_wall;        /* local clock at the previous heartbeat */
+  TimestampTz last_tstmp;       /* its timestamp */
+  XLogRecPtr  last_lsn;         /* and position */
+  bool        valid;            /* the rates below have a value */
+  double      bytes_rate;       /* WAL bytes replayed per second */
+  double      speed;            /* primary seconds replayed per second */
+  double      interval;         /* primary microseconds between heartbeats */
+} SlRate;
+
+static SlRate *sl_rate = NULL;
+
+Size
+sl_rate_shmem_size(void)
+{
+  return sizeof(SlRate);
+}
+
+void
+sl_rate_shmem_startup(void)
+{
+  bool found;
+
+  sl_rate = ShmemInitStruct("streaming_lag rate",
+                            sl_rate_shmem_size(),
+                            &found);
+  if (!found) {
+    SpinLockInit(&sl_rate->mutex);
+    sl_rate->last_wall = 0;
+    sl_rate->last_tstmp = 0;
+    sl_rate->last_lsn = InvalidXLogRecPtr;
+    sl_rate->valid = false;
+    sl_rate->bytes_rate = 0;
+    sl_rate->speed = 0;
+    sl_rate->interval = 0;
+  }
+}
+
+/*
+ * Account for a heartbeat with the given timestamp and position,
+ * replayed at local time now
+ */
+void
+sl_rate_add(TimestampTz now, TimestampTz tstmp, XLogRecPtr lsn)
+{
+  if (!sl_rate) return;
+
+  SpinLockAcquire(&sl_rate->mutex);
+
+  if (sl_rate->last_wall != 0 && now > sl_rate->last_wall &&
+      lsn >= sl_rate->last_lsn && tstmp >= sl_rate->last_tstmp) {
+    double dt = (double) (now - sl_rate->last_wall);
+    double bytes_rate = (double) (lsn - sl_rate->last_lsn) * USECS_PER_SEC / dt;
+    double dtp = (double) (tstmp - sl_rate->last_tstmp);
+    double speed = dtp / dt;
+    double alpha = 1.0 - exp(-dt / SL_RATE_TAU);
+
+    if (sl_rate->valid) {
+      sl_rate->bytes_rate += alpha * (bytes_rate - sl_rate->bytes_rate);
+      sl_rate->speed += alpha * (speed - sl_rate->speed);
+      sl_rate->interval += alpha * (dtp - sl_rate->interval);
+    } else {
+      sl_rate->bytes_rate = bytes_rate;
+      sl_rate->speed = speed;
+      sl_rate->interval = dtp;
+      sl_rate->valid = true;
+    }
+  } else if (lsn < sl_rate->last_lsn) {
+    /* a new timeline or a restart; start over */
+    sl_rate->valid = false;
+  }
+
+  sl_rate->last_wall = now;
+  sl_rate->last_tstmp = tstmp;
+  sl_rate->last_lsn = lsn;
+
+  SpinLockRelease(&sl_rate->mutex);
+}
+
+/*
+ * The smoothed rates. Returns false before two heartbeats have been
+ * replayed.
+ */
+bool
+sl_rate_get(double *bytes_rate, double *speed)
+{
+  bool valid;
+
+  if (!sl_rate) return false;
+
+  SpinLockAcquire(&sl_rate->mutex);
+  valid = sl_rate->valid;
+  *bytes_rate = sl_rate->bytes_rate;
+  *speed = sl_rate->speed;
+  SpinLockRelease(&sl_rate->mutex);
+
+  return valid;
+}
+
+/*
+ * Estimated time in microseconds until a replica with the given lag has
+ * caught up. Returns false if it is hardly catching up or the rates are
+ * stale.
+ */
+bool
+sl_rate_eta(int64 lag, int64 *eta)
+{
+  TimestampTz last_wall;
+  double interval;
+  double speed;
+  bool valid;
+
+  if (lag <= 0) {
+    *eta = 0;
+    return true;
+  }
+
+  if (!sl_rate) return false;
+
+  SpinLockAcquire(&sl_rate->mutex);
+  valid = sl_rate->valid;
+  speed = sl_rate->speed;
+  interval = sl_rate->interval;
+  last_wall = sl_rate->last_wall;
+  SpinLockRelease(&sl_rate->mutex);
+
+  if (!valid || speed <= 1.0 + SL_RATE_MIN_GAIN) return false;
+  if ((double) (GetCurrentTimestamp() - last_wall) > SL_RATE_STALE * interval)
+    return false;
+
+  *eta = (int64) (lag / (speed - 1.0));
+  return true;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_replay_rate);
+
+/*
+ * WAL bytes and primary seconds replayed per second, and the estimated
+ * time to catch up. On a primary the lag is 0 and so is the time to
+ * catch up. The rates are NULL until two heartbeats have been replayed,
+ * the time to catch up also while the lag is hardly shrinking or no
+ * heartbeat has been replayed for a while, see sl_rate_eta().
+ */
+Datum
+streaming_lag_replay_rate(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+  double bytes_rate;
+  double speed;
+  int64 lag;
+  int64 eta;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (sl_rate_get(&bytes_rate, &speed)) {
+    values[0] = Float8GetDatum(bytes_rate);
+    values[1] = Float8GetDatum(speed);
+  } else {
+    nulls[0] = nulls[1] = true;
+  }
+
+  if (sl_lsnmap_lag(&lag) && sl_rate_eta(lag, &eta))
+    values[2] = IntervalPGetDatum(sl_make_interval(eta));
+  else
+    nulls[2] = true;
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,235 @@
+/*
+ * sl_rollup.c
+ *
+ * Downsampled lag history of a replica. Every lag sample is folded into
+ * a bucket per tier: one second, one minute and one hour wide. A bucket
+ * keeps count, min, max and sum of the lag and a coarse histogram. Each
+ * tier is a ring of a fixed number of buckets, so days of history fit
+ * into a memory footprint set at server start.
+ *
+ * Like the raw history the rollups are written by the startup process
+ * only and read under an LWLock.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "port/pg_bitutils.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "streaming_lag.h"
+
+/*
+ * Histogram bin i > 0 counts lags from 2^(i-1) up to 2^i milliseconds,
+ * bin 0 those below 1ms. The last bin is open-ended, from about 70
+ * minutes up.
+ */
+#define SL_ROLLUP_BINS 24
+
+#define SL_TIER_SECOND 0
+#define SL_TIER_MINUTE 1
+#define SL_TIER_HOUR   2
+#define SL_NTIERS      3
+
+typedef struct SlBucket
+{
+  TimestampTz start;
+  int64       count;
+  int64       min;
+  int64       max;
+  int64       sum;
+  uint32      bins[SL_ROLLUP_BINS];
+} SlBucket;
+
+typedef struct SlTier
+{
+  int64       width;            /* microseconds */
+  int         size;             /* number of buckets */
+  int         offset;           /* of the first bucket in SlRollup.buckets */
+  uint64      nadded;           /* buckets started so far */
+} SlTier;
+
+typedef struct SlRollup
+{
+  SlTier      tiers[SL_NTIERS];
+  SlBucket    buckets[FLEXIBLE_ARRAY_MEMBER];
+} SlRollup;
+
+static const char *const tier_names[SL_NTIERS] = {"second", "minute", "hour"};
+
+static SlRollup *sl_rollup = NULL;
+
+static int
+tier_size(int tier)
+{
+  switch (tier) {
+  case SL_TIER_SECOND: return guc_rollup_seconds;
+  case SL_TIER_MINUTE: return guc_rollup_minutes;
+  default:             return guc_rollup_hours;
+  }
+}
+
+Size
+sl_rollup_shmem_size(void)
+{
+  return add_size(offsetof(SlRollup, buckets),
+                  mul_size(sizeof(SlBucket),
+                           (Size) guc_rollup_seconds + guc_rollup_minutes +
+                           guc_rollup_hours));
+}
+
+void
+sl_rollup_shmem_startup(void)
+{
+  bool found;
+  int offset = 0;
+  int i;
+
+  sl_rollup = ShmemInitStruct("streaming_lag rollup",
+                              sl_rollup_shmem_size(),
+                              &found);
+  if (!found) {
+    for (i = 0; i < SL_NTIERS; i++) {
+      SlTier *t = &sl_rollup->tiers[i];
+
+      t->width = (i == SL_TIER_SECOND ? USECS_PER_SEC :
+                  i == SL_TIER_MINUTE ? USECS_PER_MINUTE : USECS_PER_HOUR);
+      t->size = tier_size(i);
+      t->offset = offset;
+      t->nadded = 0;
+      offset += t->size;
+    }
+  }
+}
+
+static int
+lag_bin(int64 lag)
+{
+  int64 ms = lag / 1000;
+
+  if (ms <= 0) return 0;
+  return Min(pg_leftmost_one_pos64((uint64) ms) + 1, SL_ROLLUP_BINS - 1);
+}
+
+static inline SlBucket *
+tier_bucket(SlTier *t, uint64 i)
+{
+  return &sl_rollup->buckets[t->offset + i % t->size];
+}
+
+void
+sl_rollup_add(TimestampTz sample_time, int64 lag)
+{
+  int i;
+  int bin = lag_bin(lag);
+
+  if (!sl_rollup) return;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_ROLLUP), LW_EXCLUSIVE);
+
+  for (i = 0; i < SL_NTIERS; i++) {
+    SlTier *t = &sl_rollup->tiers[i];
+    TimestampTz start;
+    SlBucket *b;
+
+    if (t->size <= 0) continue;
+
+    start = sample_time - sample_time % t->width;
+    b = t->nadded > 0 ? tier_bucket(t, t->nadded - 1) : NULL;
+
+    if (b == NULL || b->start != start) {
+      b = tier_bucket(t, t->nadded++);
+      memset(b, 0, sizeof(*b));
+      b->start = start;
+      b->min = lag;
+      b->max = lag;
+    }
+
+    b->count++;
+    b->sum += lag;
+    if (lag < b->min) b->min = lag;
+    if (lag > b->max) b->max = lag;
+    b->bins[bin]++;
+  }
+
+  LWLockRelease(sl_lwlock(SL_LWLOCK_ROLLUP));
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_rollup);
+
+/*
+ * The buckets of a tier, oldest first
+ */
+Datum
+streaming_lag_rollup(PG_FUNCTION_ARGS)
+{
+  char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  SlTier *t;
+  SlBucket *copy;
+  uint64 first;
+  uint64 n;
+  uint64 i;
+  int tier;
+
+  for (tier = 0; tier < SL_NTIERS; tier++)
+    if (strcmp(name, tier_names[tier]) == 0) break;
+
+  if (tier == SL_NTIERS) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("unknown rollup tier \"%s\"", name),
+                    errhint("Valid tiers are \"second\", \"minute\" and \"hour\".")));
+  }
+
+  tupstore = sl_srf_begin(fcinfo, &tupdesc);
+
+  if (!sl_rollup || sl_rollup->tiers[tier].size <= 0) return (Datum) 0;
+
+  t = &sl_rollup->tiers[tier];
+  copy = (SlBucket *) palloc(sizeof(SlBucket) * t->size);
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_ROLLUP), LW_SHARED);
+  n = t->nadded;
+  first = n > (uint64) t->size ? n - t->size : 0;
+  for (i = first; i < n; i++) copy[i - first] = *tier_bucket(t, i);
+  LWLockRelease(sl_lwlock(SL_LWLOCK_ROLLUP));
+
+  for (i = 0; i < n - first; i++) {
+    SlBucket *b = &copy[i];
+    Datum values[6];
+    bool nulls[6] = {false, false, false, false, false, false};
+    Datum bins[SL_ROLLUP_BINS];
+    int j;
+
+    for (j = 0; j < SL_ROLLUP_BINS; j++) bins[j] = Int64GetDatum(b->bins[j]);
+
+    values[0] = TimestampTzGetDatum(b->start);
+    values[1] = Int64GetDatum(b->count);
+    values[2] = IntervalPGetDatum(sl_make_interval(b->min));
+    values[3] = IntervalPGetDatum(sl_make_interval(b->max));
+    values[4] = IntervalPGetDatum(sl_make_interval(b->sum / b->count));
+    values[5] = PointerGetDatum(construct_array(bins, SL_ROLLUP_BINS, INT8OID,
+                                                sizeof(int64), FLOAT8PASSBYVAL,
+                                                TYPALIGN_DOUBLE));
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
@@ -0,0 +1,534 @@
+/*
+ * sl_shmem.c
+ *
+ * Shared memory state of the streaming_lag extension. It holds the
+ * latest heartbeat seen by this server, i.e. the one written by the
+ * worker on the primary or the one replayed on a replica.
+ *
+ * There is only ever one writer, the worker on a primary or the startup
+ * process on a replica. Readers never block it: the state is protected
+ * by a change counter which is odd while an update is in progress, and
+ * readers simply retry if it moved while they copied the state.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/rmgr.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "access/xlogrecovery.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+typedef struct StreamingLagShared
+{
+  pg_atomic_uint32 changecount; /* odd while the fields below change */
+  TimestampTz tstmp;            /* latest heartbeat, 0 if none seen yet */
+  XLogRecPtr  lsn;              /* end of the WAL record carrying it */
+  TimeLineID  tli;              /* timeline it was written on */
+  ConditionVariable heartbeat_cv;       /* broadcast on every heartbeat */
+  pg_atomic_uint64 xact_time;   /* of the latest replayed commit or abort */
+  pg_atomic_uint64 redone_lsn;  /* end of the latest record redone */
+  pg_atomic_uint64 wait_lsn;    /* least LSN waited for, 0 if none */
+  pg_atomic_uint32 launcher;    /* bumped as a main worker starts or exits */
+
+  /* heartbeat worker statistics, written by the worker only */
+  pg_atomic_uint64 ticks;
+  pg_atomic_uint64 missed_ticks;        /* coalesced into a later tick */
+  pg_atomic_uint64 jitter_last;         /* microseconds behind schedule */
+  pg_atomic_uint64 jitter_max;
+  pg_atomic_uint64 heartbeats;          /* ticks that wrote a heartbeat */
+  pg_atomic_uint64 tick_time_last;      /* microseconds */
+  pg_atomic_uint64 tick_time_max;
+  pg_atomic_uint64 tick_time_total;
+  pg_atomic_uint64 exec_time_total;
+  pg_atomic_uint64 commit_time_total;
+  pg_atomic_uint64 wal_bytes;
+} StreamingLagShared;
+
+static StreamingLagShared *sl_shared = NULL;
+static LWLockPadded *sl_locks = NULL;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void
+sl_shmem_request(void)
+{
+  if (prev_shmem_request_hook) prev_shmem_request_hook();
+
+  RequestAddinShmemSpace(MAXALIGN(sizeof(StreamingLagShared)));
+  RequestAddinShmemSpace(MAXALIGN(sl_lsnmap_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_history_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_rollup_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_histogram_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_clock_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_rate_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_database_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_hops_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_logical_shmem_size()));
+  RequestAddinShmemSpace(MAXALIGN(sl_stall_shmem_size()));
+  RequestNamedLWLockTranche("streaming_lag", SL_NUM_LWLOCKS);
+}
+
+static void
+sl_shmem_startup(void)
+{
+  bool found;
+
+  if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  sl_shared = ShmemInitStruct("streaming_lag",
+                              sizeof(StreamingLagShared),
+                              &found);
+  if (!found) {
+    pg_atomic_init_u32(&sl_shared->changecount, 0);
+    sl_shared->tstmp = 0;
+    sl_shared->lsn = InvalidXLogRecPtr;
+    sl_shared->tli = 0;
+    ConditionVariableInit(&sl_shared->heartbeat_cv);
+    pg_atomic_init_u64(&sl_shared->xact_time, 0);
+    pg_atomic_init_u64(&sl_shared->redone_lsn, InvalidXLogRecPtr);
+    pg_atomic_init_u64(&sl_shared->wait_lsn, InvalidXLogRecPtr);
+    pg_atomic_init_u32(&sl_shared->launcher, 0);
+    pg_atomic_init_u64(&sl_shared->ticks, 0);
+    pg_atomic_init_u64(&sl_shared->missed_ticks, 0);
+    pg_atomic_init_u64(&sl_shared->jitter_last, 0);
+    pg_atomic_init_u64(&sl_shared->jitter_max, 0);
+    pg_atomic_init_u64(&sl_shared->heartbeats, 0);
+    pg_atomic_init_u64(&sl_shared->tick_time_last, 0);
+    pg_atomic_init_u64(&sl_shared->tick_time_max, 0);
+    pg_atomic_init_u64(&sl_shared->tick_time_total, 0);
+    pg_atomic_init_u64(&sl_shared->exec_time_total, 0);
+    pg_atomic_init_u64(&sl_shared->commit_time_total, 0);
+    pg_atomic_init_u64(&sl_shared->wal_bytes, 0);
+  }
+
+  sl_locks = GetNamedLWLockTranche("streaming_lag");
+
+  sl_lsnmap_shmem_startup();
+  sl_history_shmem_startup();
+  sl_rollup_shmem_startup();
+  sl_histogram_shmem_startup();
+  sl_clock_shmem_startup();
+  sl_rate_shmem_startup();
+  sl_database_shmem_startup();
+  sl_hops_shmem_startup();
+  sl_logical_shmem_startup();
+  sl_stall_shmem_startup();
+
+  LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Install the shared memory hooks. Must be called from _PG_init while
+ * shared_preload_libraries is processed.
+ */
+void
+sl_shmem_init(void)
+{
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = sl_shmem_request;
+
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = sl_shmem_startup;
+}
+
+LWLock *
+sl_lwlock(int id)
+{
+  return &sl_locks[id].lock;
+}
+
+void
+sl_state_set(TimestampTz tstmp, XLogRecPtr lsn, TimeLineID tli)
+{
+  if (!sl_shared) return;
+
+  /* the atomic increments act as full barriers */
+  pg_atomic_fetch_add_u32(&sl_shared->changecount, 1);
+  sl_shared->tstmp = tstmp;
+  sl_shared->lsn = lsn;
+  sl_shared->tli = tli;
+  pg_atomic_fetch_add_u32(&sl_shared->changecount, 1);
+
+  sl_lsnmap_add(SL_ANCHOR_HEARTBEAT, lsn, tstmp, tli);
+
+  ConditionVariableBroadcast(&sl_shared->heartbeat_cv);
+}
+
+/*
+ * The condition variable sessions waiting for the next heartbeat or a
+ * replayed LSN sleep on
+ */
+ConditionVariable *
+sl_heartbeat_cv(void)
+{
+  return sl_shared ? &sl_shared->heartbeat_cv : NULL;
+}
+
+/*
+ * Fetch the latest heartbeat. Returns false if the library was not
+ * preloaded or no heartbeat has been seen since the server started.
+ */
+bool
+sl_state_get(TimestampTz *tstmp, XLogRecPtr *lsn, TimeLineID *tli)
+{
+  TimestampTz t;
+  XLogRecPtr l;
+  TimeLineID tl;
+  uint32 before;
+  uint32 after;
+
+  if (!sl_shared) return false;
+
+  for (;;) {
+    before = pg_atomic_read_u32(&sl_shared->changecount);
+    pg_read_barrier();
+    t = sl_shared->tstmp;
+    l = sl_shared->lsn;
+    tl = sl_shared->tli;
+    pg_read_barrier();
+    after = pg_atomic_read_u32(&sl_shared->changecount);
+
+    if (before == after && (before & 1) == 0) break;
+    pg_spin_delay();
+  }
+
+  if (t == 0) return false;
+
+  if (tstmp) *tstmp = t;
+  if (lsn) *lsn = l;
+  if (tli) *tli = tl;
+  return true;
+}
+
+/*
+ * Called by the startup process after the redo of every record, see
+ * sl_stall.c. It wakes the sessions waiting for an LSN the record ends
+ * at or before, and notes the time of replayed commits and aborts, as
+ * GetLatestXTime() does, but where readers need no lock.
+ */
+void
+sl_redo_done(XLogReaderState *record)
+{
+  uint64 target;
+  uint8 info;
+
+  if (!sl_shared) return;
+
+  /* pairs with the barrier in sl_wait_lsn_watch() */
+  pg_atomic_write_u64(&sl_shared->redone_lsn, record->EndRecPtr);
+  pg_memory_barrier();
+
+  target = pg_atomic_read_u64(&sl_shared->wait_lsn);
+  while (target != InvalidXLogRecPtr && target <= record->EndRecPtr) {
+    if (pg_atomic_compare_exchange_u64(&sl_shared->wait_lsn, &target,
+                                       InvalidXLogRecPtr)) {
+      ConditionVariableBroadcast(&sl_shared->heartbeat_cv);
+      break;
+    }
+  }
+
+  if (XLogRecGetRmid(record) != RM_XACT_ID) return;
+
+  info = XLogRecGetInfo(record) & XLOG_XACT_OPMASK;
+  if (info == XLOG_XACT_COMMIT || info == XLOG_XACT_COMMIT_PREPARED) {
+    pg_atomic_write_u64(&sl_shared->xact_time, (uint64)
+                        ((xl_xact_commit *) XLogRecGetData(record))->xact_time);
+  } else if (info == XLOG_XACT_ABORT || info == XLOG_XACT_ABORT_PREPARED) {
+    pg_atomic_write_u64(&sl_shared->xact_time, (uint64)
+                        ((xl_xact_abort *) XLogRecGetData(record))->xact_time);
+  }
+}
+
+/*
+ * Have the heartbeat condition variable broadcast once redo has passed
+ * lsn. Returns the end of the latest record redone, which may be past
+ * lsn already. Either the startup process sees the LSN or the caller
+ * sees its redo, so no wakeup is lost.
+ */
+XLogRecPtr
+sl_wait_lsn_watch(XLogRecPtr lsn)
+{
+  uint64 cur;
+
+  if (!sl_shared) return InvalidXLogRecPtr;
+
+  cur = pg_atomic_read_u64(&sl_shared->wait_lsn);
+  while (cur == InvalidXLogRecPtr || cur > lsn) {
+    if (pg_atomic_compare_exchange_u64(&sl_shared->wait_lsn, &cur, lsn))
+      break;
+  }
+  pg_memory_barrier();
+
+  return (XLogRecPtr) pg_atomic_read_u64(&sl_shared->redone_lsn);
+}
+
+/*
+ * Commit or abort time of the latest transaction replayed since the
+ * server started, 0 if none
+ */
+TimestampTz
+sl_xact_time(void)
+{
+  if (!sl_shared) return 0;
+  return (TimestampTz) pg_atomic_read_u64(&sl_shared->xact_time);
+}
+
+/*
+ * The primary's clock as far as this server knows it: the latest
+ * heartbeat or, on a replica, the commit time of the latest replayed
+ * transaction if that is newer. A busy primary skipping heartbeats
+ * relies on the latter. Returns false if neither is known. Takes no
+ * lock.
+ */
+bool
+sl_primary_time(TimestampTz *tstmp)
+{
+  TimestampTz t = 0;
+  TimestampTz xtime;
+
+  (void) sl_state_get(&t, NULL, NULL);
+
+  if (RecoveryInProgress()) {
+    xtime = sl_xact_time();
+    if (xtime > t) t = xtime;
+  }
+
+  if (t == 0) return false;
+
+  *tstmp = t;
+  return true;
+}
+
+/*
+ * Generation of the main worker, which starts the workers for further
+ * databases. It changes as a main worker starts and as it exits, so a
+ * worker started by one can tell whether that one is still there, even
+ * if its PID has been reused. sl_launcher_bump() returns the new one.
+ */
+uint32
+sl_launcher_bump(void)
+{
+  if (!sl_shared) return 0;
+  return pg_atomic_add_fetch_u32(&sl_shared->launcher, 1);
+}
+
+uint32
+sl_launcher_generation(void)
+{
+  if (!sl_shared) return 0;
+  return pg_atomic_read_u32(&sl_shared->launcher);
+}
+
+/*
+ * Account for a tick of the heartbeat worker that fired jitter
+ * microseconds late after missing the given number of earlier ones
+ */
+void
+sl_stats_tick(int64 jitter, int64 missed)
+{
+  if (!sl_shared) return;
+
+  pg_atomic_fetch_add_u64(&sl_shared->ticks, 1);
+  if (missed > 0) pg_atomic_fetch_add_u64(&sl_shared->missed_ticks, missed);
+
+  pg_atomic_write_u64(&sl_shared->jitter_last, jitter);
+  if ((uint64) jitter > pg_atomic_read_u64(&sl_shared->jitter_max))
+    pg_atomic_write_u64(&sl_shared->jitter_max, jitter);
+}
+
+/*
+ * Account for a heartbeat that took tick_time microseconds in total,
+ * exec_time of them for the UPDATE and commit_time for the commit, and
+ * wrote wal_bytes of WAL
+ */
+void
+sl_stats_heartbeat(int64 tick_time, int64 exec_time, int64 commit_time,
+                   uint64 wal_bytes)
+{
+  if (!sl_shared) return;
+
+  pg_atomic_fetch_add_u64(&sl_shared->heartbeats, 1);
+  pg_atomic_write_u64(&sl_shared->tick_time_last, tick_time);
+  if ((uint64) tick_time > pg_atomic_read_u64(&sl_shared->tick_time_max))
+    pg_atomic_write_u64(&sl_shared->tick_time_max, tick_time);
+  pg_atomic_fetch_add_u64(&sl_shared->tick_time_total, tick_time);
+  pg_atomic_fetch_add_u64(&sl_shared->exec_time_total, exec_time);
+  pg_atomic_fetch_add_u64(&sl_shared->commit_time_total, commit_time);
+  pg_atomic_fetch_add_u64(&sl_shared->wal_bytes, wal_bytes);
+}
+
+/*
+ * Copy the statistics of the heartbeat worker
+ */
+void
+sl_stats_get(SlWorkerStats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  if (!sl_shared) return;
+
+  stats->ticks = pg_atomic_read_u64(&sl_shared->ticks);
+  stats->missed_ticks = pg_atomic_read_u64(&sl_shared->missed_ticks);
+  stats->jitter_last = pg_atomic_read_u64(&sl_shared->jitter_last);
+  stats->jitter_max = pg_atomic_read_u64(&sl_shared->jitter_max);
+  stats->heartbeats = pg_atomic_read_u64(&sl_shared->heartbeats);
+  stats->tick_time_last = pg_atomic_read_u64(&sl_shared->tick_time_last);
+  stats->tick_time_max = pg_atomic_read_u64(&sl_shared->tick_time_max);
+  stats->tick_time_total = pg_atomic_read_u64(&sl_shared->tick_time_total);
+  stats->exec_time_total = pg_atomic_read_u64(&sl_shared->exec_time_total);
+  stats->commit_time_total = pg_atomic_read_u64(&sl_shared->commit_time_total);
+  stats->wal_bytes = pg_atomic_read_u64(&sl_shared->wal_bytes);
+}
+
+/*
+ * Interval of the given number of microseconds, as the lag functions
+ * return it
+ */
+Interval *
+sl_make_interval(int64 usec)
+{
+  Interval *result = (Interval *) palloc0(sizeof(Interval));
+
+  result->time = usec;
+  return result;
+}
+
+/* length of an interval in microseconds, a month counting 30 days */
+int64
+sl_interval_usec(const Interval *interval)
+{
+  return interval->time +
+    ((int64) interval->month * DAYS_PER_MONTH + interval->day) * USECS_PER_DAY;
+}
+
+/*
+ * Set up a set returning function in materialize mode and return the
+ * tuplestore to put the rows into
+ */
+Tuplestorestate *
+sl_srf_begin(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  MemoryContext oldcontext;
+  Tuplestorestate *tupstore;
+
+  if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo)) {
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("set-valued function called in context that "
+                           "cannot accept a set")));
+  }
+  if (!(rsinfo->allowedModes & SFRM_Materialize)) {
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("materialize mode required, but it is not "
+                           "allowed in this context")));
+  }
+  if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+  *tupdesc = CreateTupleDescCopy(*tupdesc);
+  tupstore = tuplestore_begin_heap(true, false, work_mem);
+  rsinfo->returnMode = SFRM_Materialize;
+  rsinfo->setResult = tupstore;
+  rsinfo->setDesc = *tupdesc;
+
+  MemoryContextSwitchTo(oldcontext);
+
+  return tupstore;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_now);
+PG_FUNCTION_INFO_V1(streaming_lag_timeline);
+PG_FUNCTION_INFO_V1(streaming_lag_worker_stats);
+
+/*
+ * Timestamp of the latest heartbeat or replayed commit, i.e. the
+ * primary's clock as far as this server knows it, see
+ * sl_primary_time(). NULL if the library is not preloaded or there was
+ * neither since the server started. The streaming_lag view falls back
+ * to the table in that case. With streaming_lag.clock_correction on, a
+ * replica translates the time to its own clock.
+ */
+Datum
+streaming_lag_now(PG_FUNCTION_ARGS)
+{
+  TimestampTz tstmp;
+
+  if (!sl_primary_time(&tstmp)) PG_RETURN_NULL();
+
+  PG_RETURN_TIMESTAMPTZ(sl_clock_correct(tstmp));
+}
+
+/*
+ * Timeline the latest heartbeat was written on. NULL if there was none
+ * since the server started.
+ */
+Datum
+streaming_lag_timeline(PG_FUNCTION_ARGS)
+{
+  TimeLineID tli;
+
+  if (!sl_state_get(NULL, NULL, &tli)) PG_RETURN_NULL();
+
+  PG_RETURN_INT64((int64) tli);
+}
+
+/*
+ * Statistics of the heartbeat worker of this server since it started.
+ * Times are averages over the heartbeats written.
+ */
+Datum
+streaming_lag_worker_stats(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  SlWorkerStats ws;
+  Datum values[11];
+  bool nulls[11];
+  uint64 n;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  sl_stats_get(&ws);
+  n = Max(ws.heartbeats, 1);
+  memset(nulls, 0, sizeof(nulls));
+
+  values[0] = Int64GetDatum((int64) ws.ticks);
+  values[1] = Int64GetDatum((int64) ws.missed_ticks);
+  values[2] = Int64GetDatum((int64) ws.heartbeats);
+  values[3] = IntervalPGetDatum(sl_make_interval((int64) ws.tick_time_last));
+  values[4] = IntervalPGetDatum(sl_make_interval((int64) (ws.tick_time_total / n)));
+  values[5] = IntervalPGetDatum(sl_make_interval((int64) ws.tick_time_max));
+  values[6] = IntervalPGetDatum(sl_make_interval((int64) (ws.exec_time_total / n)));
+  values[7] = IntervalPGetDatum(sl_make_interval((int64) (ws.commit_time_total / n)));
+  values[8] = IntervalPGetDatum(sl_make_interval((int64) ws.jitter_last));
+  values[9] = IntervalPGetDatum(sl_make_interval((int64) ws.jitter_max));
+  values[10] = Int64GetDatum((int64) ws.wal_bytes);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
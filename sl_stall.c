@@ -0,0 +1,450 @@
+/*
+ * sl_stall.c
+ *
+ * What replay was doing while a replica fell behind. Whenever the lag
+ * of the standby exceeds streaming_lag.stall_threshold a stall is
+ * opened, and it is closed when the lag drops below again. While it
+ * lasts
+ *
+ *  - the startup process counts the records, bytes and full page
+ *    images it replays, and the time their redo takes, per resource
+ *    manager. At the start of redo it puts a wrapper in front of the
+ *    redo routine of every resource manager in its RmgrTable, which
+ *    does nothing but call the original and sl_redo_done() unless a
+ *    stall is open.
+ *
+ *  - the main worker, which waits for promotion on a standby anyway,
+ *    samples the wait event of the startup process every
+ *    PROMOTION_POLL_MS and adds the time since the previous sample to
+ *    what it is doing: replaying, reading or writing data files,
+ *    waiting for a recovery conflict with the queries on the standby,
+ *    waiting for WAL to arrive, or held back by a pause or by
+ *    recovery_min_apply_delay.
+ *
+ * The latest SL_STALLS stalls are kept in shared memory. The worker
+ * writes their times under the stalls LWLock. The counters per
+ * resource manager are written by the startup process only and read
+ * without a lock, so those of an ongoing stall may be a record off.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/wait_event.h"
+
+#include "streaming_lag.h"
+
+/* stalls kept */
+#define SL_STALLS 16
+
+/* what the startup process was found doing */
+#define SL_STALL_REPLAY     0
+#define SL_STALL_IO         1
+#define SL_STALL_CONFLICT   2
+#define SL_STALL_WAL        3
+#define SL_STALL_DELAY      4
+#define SL_STALL_OTHER      5
+#define SL_STALL_NWAITS     6
+
+static const char *const wait_names[SL_STALL_NWAITS] = {
+  "replay", "I/O", "recovery conflict", "waiting for WAL", "delay", "other"
+};
+
+typedef struct SlStallRmgr
+{
+  uint64      records;
+  uint64      bytes;
+  uint64      fpis;
+  uint64      redo_time;        /* microseconds */
+} SlStallRmgr;
+
+typedef struct SlStall
+{
+  uint64      id;               /* 0 if the slot was never used */
+  TimestampTz started;
+  TimestampTz ended;            /* 0 while the stall lasts */
+  int64       max_lag;          /* microseconds */
+  int64       waits[SL_STALL_NWAITS];   /* microseconds sampled */
+  SlStallRmgr rmgrs[RM_MAX_ID + 1];
+} SlStall;
+
+typedef struct SlStalls
+{
+  pg_atomic_uint32 active;      /* slot + 1 of the open stall, 0 if none */
+  pg_atomic_uint32 startup_pid;
+  uint64      nstalls;
+  SlStall     stalls[SL_STALLS];
+} SlStalls;
+
+static SlStalls *sl_stalls = NULL;
+
+/* redo routines of the startup process, before stall_redo took over */
+static void (*orig_redo[RM_MAX_ID + 1]) (XLogReaderState *record);
+static bool installed = false;
+
+/* of the worker */
+static TimestampTz last_sample = 0;
+
+Size
+sl_stall_shmem_size(void)
+{
+  return sizeof(SlStalls);
+}
+
+void
+sl_stall_shmem_startup(void)
+{
+  bool found;
+
+  sl_stalls = ShmemInitStruct("streaming_lag stalls",
+                              sl_stall_shmem_size(),
+                              &found);
+  if (!found) {
+    memset(sl_stalls, 0, sizeof(SlStalls));
+    pg_atomic_init_u32(&sl_stalls->active, 0);
+    pg_atomic_init_u32(&sl_stalls->startup_pid, 0);
+  }
+}
+
+static void
+stall_redo(XLogReaderState *record)
+{
+  RmgrId rmid = XLogRecGetRmid(record);
+  uint32 active = pg_atomic_read_u32(&sl_stalls->active);
+  SlStallRmgr *r;
+  instr_time start;
+  instr_time duration;
+  int block_id;
+
+  if (active == 0) {
+    orig_redo[rmid](record);
+    sl_redo_done(record);
+    return;
+  }
+
+  INSTR_TIME_SET_CURRENT(start);
+  orig_redo[rmid](record);
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, start);
+
+  r = &sl_stalls->stalls[active - 1].rmgrs[rmid];
+  r->records++;
+  r->bytes += XLogRecGetTotalLen(record);
+  for (block_id = 0; block_id <= XLogRecMaxBlockId(record); block_id++) {
+    if (XLogRecHasBlockRef(record, block_id) &&
+        XLogRecHasBlockImage(record, block_id))
+      r->fpis++;
+  }
+  r->redo_time += INSTR_TIME_GET_MICROSEC(duration);
+
+  sl_redo_done(record);
+}
+
+/*
+ * Wrap the redo routines. Called by the startup process as redo
+ * starts, after every resource manager has been registered.
+ */
+void
+sl_stall_install(void)
+{
+  int rmid;
+
+  if (installed || !sl_stalls) return;
+
+  for (rmid = 0; rmid <= RM_MAX_ID; rmid++) {
+    if (!RmgrIdExists(rmid) || RmgrTable[rmid].rm_redo == NULL) continue;
+    orig_redo[rmid] = RmgrTable[rmid].rm_redo;
+    RmgrTable[rmid].rm_redo = stall_redo;
+  }
+  installed = true;
+
+  pg_atomic_write_u32(&sl_stalls->startup_pid, (uint32) MyProcPid);
+}
+
+/* and put the originals back as redo is done */
+void
+sl_stall_uninstall(void)
+{
+  int rmid;
+
+  if (!installed) return;
+
+  for (rmid = 0; rmid <= RM_MAX_ID; rmid++) {
+    if (orig_redo[rmid] != NULL) RmgrTable[rmid].rm_redo = orig_redo[rmid];
+  }
+  installed = false;
+
+  pg_atomic_write_u32(&sl_stalls->startup_pid, 0);
+}
+
+/* what the wait event of the startup process says it is doing */
+static int
+startup_doing(void)
+{
+  pid_t pid = (pid_t) pg_atomic_read_u32(&sl_stalls->startup_pid);
+  PGPROC *proc = pid ? AuxiliaryPidGetProc(pid) : NULL;
+  uint32 info;
+
+  if (proc == NULL) return SL_STALL_OTHER;
+  info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+
+  switch (info & 0xFF000000) {
+  case 0:
+    return SL_STALL_REPLAY;
+  case PG_WAIT_IO:
+    return SL_STALL_IO;
+  case PG_WAIT_LOCK:
+#if PG_VERSION_NUM >= 170000
+  case PG_WAIT_BUFFERPIN:
+#else
+  case PG_WAIT_BUFFER_PIN:
+#endif
+    return SL_STALL_CONFLICT;
+  }
+
+  switch (info) {
+  case WAIT_EVENT_RECOVERY_CONFLICT_SNAPSHOT:
+  case WAIT_EVENT_RECOVERY_CONFLICT_TABLESPACE:
+    return SL_STALL_CONFLICT;
+  case WAIT_EVENT_RECOVERY_WAL_STREAM:
+  case WAIT_EVENT_RECOVERY_RETRIEVE_RETRY_INTERVAL:
+    return SL_STALL_WAL;
+  case WAIT_EVENT_RECOVERY_PAUSE:
+  case WAIT_EVENT_RECOVERY_APPLY_DELAY:
+    return SL_STALL_DELAY;
+  }
+
+  return SL_STALL_OTHER;
+}
+
+/* close the open stall, if any */
+void
+sl_stall_stop(void)
+{
+  uint32 active;
+
+  if (!sl_stalls) return;
+
+  active = pg_atomic_exchange_u32(&sl_stalls->active, 0);
+  if (active == 0) return;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_STALLS), LW_EXCLUSIVE);
+  sl_stalls->stalls[active - 1].ended = GetCurrentTimestamp();
+  LWLockRelease(sl_lwlock(SL_LWLOCK_STALLS));
+}
+
+/*
+ * Take a sample on a standby: open a stall if the lag exceeds the
+ * threshold, account for the time since the previous sample if one is
+ * open, and close it once the lag is below the threshold again
+ */
+void
+sl_stall_sample(void)
+{
+  TimestampTz now = GetCurrentTimestamp();
+  int64 threshold = (int64) guc_stall_threshold * 1000;
+  TimestampTz tstmp;
+  uint32 active;
+  SlStall *s;
+  int64 lag;
+
+  if (!sl_stalls) return;
+
+  if (guc_stall_threshold <= 0 || !sl_primary_time(&tstmp)) {
+    sl_stall_stop();
+    return;
+  }
+  lag = now - sl_clock_correct(tstmp);
+
+  active = pg_atomic_read_u32(&sl_stalls->active);
+  if (active == 0) {
+    if (lag >= threshold) {
+      LWLockAcquire(sl_lwlock(SL_LWLOCK_STALLS), LW_EXCLUSIVE);
+      active = sl_stalls->nstalls % SL_STALLS + 1;
+      s = &sl_stalls->stalls[active - 1];
+      memset(s, 0, sizeof(SlStall));
+      s->id = ++sl_stalls->nstalls;
+      s->started = now;
+      s->max_lag = lag;
+      LWLockRelease(sl_lwlock(SL_LWLOCK_STALLS));
+
+      /* the lock release is a barrier, the slot is clean before use */
+      pg_atomic_write_u32(&sl_stalls->active, active);
+    }
+    last_sample = now;
+    return;
+  }
+
+  s = &sl_stalls->stalls[active - 1];
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_STALLS), LW_EXCLUSIVE);
+  if (last_sample > 0 && now > last_sample)
+    s->waits[startup_doing()] += now - last_sample;
+  if (lag > s->max_lag) s->max_lag = lag;
+  LWLockRelease(sl_lwlock(SL_LWLOCK_STALLS));
+
+  last_sample = now;
+
+  if (lag < threshold) sl_stall_stop();
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_stalls);
+PG_FUNCTION_INFO_V1(streaming_lag_stall_rmgrs);
+
+/* copy the stalls, oldest first, into a palloc'd array */
+static int
+stalls_copy(SlStall **copy)
+{
+  uint64 i;
+  uint64 first;
+  int n = 0;
+
+  *copy = (SlStall *) palloc(sizeof(SlStall) * SL_STALLS);
+  if (!sl_stalls) return 0;
+
+  LWLockAcquire(sl_lwlock(SL_LWLOCK_STALLS), LW_SHARED);
+  first = sl_stalls->nstalls > SL_STALLS ? sl_stalls->nstalls - SL_STALLS : 0;
+  for (i = first; i < sl_stalls->nstalls; i++)
+    (*copy)[n++] = sl_stalls->stalls[i % SL_STALLS];
+  LWLockRelease(sl_lwlock(SL_LWLOCK_STALLS));
+
+  return n;
+}
+
+/*
+ * The latest stalls with the time the startup process was found doing
+ * what, what it replayed and the heartbeats of the lag history that
+ * fell into them. cause is the largest of the times, top_rmgr the
+ * resource manager whose records took longest to replay.
+ */
+Datum
+streaming_lag_stalls(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  TimestampTz now = GetCurrentTimestamp();
+  SlStall *stalls;
+  SlSample *samples;
+  int nsamples = 0;
+  int n;
+  int i;
+
+  n = stalls_copy(&stalls);
+  if (n > 0) nsamples = sl_history_window(stalls[0].started, &samples);
+
+  for (i = 0; i < n; i++) {
+    SlStall *s = &stalls[i];
+    TimestampTz ended = s->ended ? s->ended : now;
+    Datum values[18];
+    bool nulls[18];
+    uint64 records = 0;
+    uint64 bytes = 0;
+    uint64 fpis = 0;
+    int64 heartbeats = 0;
+    int top_rmgr = -1;
+    int cause = SL_STALL_OTHER;
+    int j;
+
+    for (j = 0; j <= RM_MAX_ID; j++) {
+      SlStallRmgr *r = &s->rmgrs[j];
+
+      if (r->records == 0) continue;
+      records += r->records;
+      bytes += r->bytes;
+      fpis += r->fpis;
+      if (top_rmgr < 0 || r->redo_time > s->rmgrs[top_rmgr].redo_time)
+        top_rmgr = j;
+    }
+
+    for (j = 0; j < SL_STALL_NWAITS; j++) {
+      if (s->waits[j] > s->waits[cause]) cause = j;
+    }
+
+    for (j = 0; j < nsamples; j++) {
+      if (samples[j].sample_time >= s->started &&
+          samples[j].sample_time <= ended)
+        heartbeats++;
+    }
+
+    memset(nulls, 0, sizeof(nulls));
+    values[0] = Int64GetDatum((int64) s->id);
+    values[1] = TimestampTzGetDatum(s->started);
+    values[2] = TimestampTzGetDatum(s->ended);
+    nulls[2] = s->ended == 0;
+    values[3] = IntervalPGetDatum(sl_make_interval(ended - s->started));
+    values[4] = IntervalPGetDatum(sl_make_interval(s->max_lag));
+    values[5] = Int64GetDatum(heartbeats);
+    for (j = 0; j < SL_STALL_NWAITS; j++)
+      values[6 + j] = IntervalPGetDatum(sl_make_interval(s->waits[j]));
+    values[12] = Int64GetDatum((int64) records);
+    values[13] = Int64GetDatum((int64) bytes);
+    values[14] = Int64GetDatum((int64) fpis);
+    values[15] = CStringGetTextDatum(wait_names[cause]);
+    nulls[15] = s->waits[cause] == 0;
+    nulls[16] = top_rmgr < 0 || !RmgrIdExists(top_rmgr);
+    if (!nulls[16])
+      values[16] = CStringGetTextDatum(GetRmgr(top_rmgr).rm_name);
+    values[17] = BoolGetDatum(s->ended == 0);
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * Per stall and resource manager, what the startup process replayed
+ * and how long it took
+ */
+Datum
+streaming_lag_stall_rmgrs(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = sl_srf_begin(fcinfo, &tupdesc);
+  SlStall *stalls;
+  int n;
+  int i;
+  int j;
+
+  n = stalls_copy(&stalls);
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j <= RM_MAX_ID; j++) {
+      SlStallRmgr *r = &stalls[i].rmgrs[j];
+      Datum values[6];
+      bool nulls[6] = {false, false, false, false, false, false};
+
+      if (r->records == 0 || !RmgrIdExists(j)) continue;
+
+      values[0] = Int64GetDatum((int64) stalls[i].id);
+      values[1] = CStringGetTextDatum(GetRmgr(j).rm_name);
+      values[2] = Int64GetDatum((int64) r->records);
+      values[3] = Int64GetDatum((int64) r->bytes);
+      values[4] = Int64GetDatum((int64) r->fpis);
+      values[5] = IntervalPGetDatum(sl_make_interval((int64) r->redo_time));
+      tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+  }
+
+  return (Datum) 0;
+}
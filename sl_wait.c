@@ -0,0 +1,127 @@
+/*
+ * sl_wait.c
+ *
+ * Functions blocking until a replica has caught up, for routing reads
+ * that must see a recent write. The session sleeps on the heartbeat
+ * condition variable. A wait for an LSN is woken by the startup process
+ * as soon as it has redone the record ending there, see sl_redo_done().
+ * The interpolated lag also shrinks as replay moves between heartbeats,
+ * to a bound no single LSN stands for, so a wait for the lag is woken by
+ * heartbeats and otherwise polls every SL_WAIT_POLL_MS.
+ *
+ * On a primary every condition is met at once.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "access/xlogrecovery.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+#define SL_WAIT_POLL_MS 10
+
+#define SL_WAIT_LAG 0
+#define SL_WAIT_LSN 1
+
+/* is the condition a waiter waits for met? */
+static bool
+wait_done(int what, int64 max_lag, XLogRecPtr lsn)
+{
+  int64 lag;
+
+  if (!RecoveryInProgress()) return true;
+
+  if (what == SL_WAIT_LSN)
+    return GetXLogReplayRecPtr(NULL) >= lsn || sl_wait_lsn_watch(lsn) >= lsn;
+
+  return sl_lsnmap_lag(&lag) && lag <= max_lag;
+}
+
+/*
+ * Wait until the condition is met or the timeout expires. Returns false
+ * in the latter case.
+ */
+static bool
+wait_for(int what, int64 max_lag, XLogRecPtr lsn, int64 timeout)
+{
+  ConditionVariable *cv = sl_heartbeat_cv();
+  TimestampTz deadline = GetCurrentTimestamp() + Max(timeout, 0);
+  bool done;
+
+  if (cv) ConditionVariablePrepareToSleep(cv);
+
+  for (;;) {
+    TimestampTz now;
+    long sleep_ms;
+
+    done = wait_done(what, max_lag, lsn);
+    if (done) break;
+
+    now = GetCurrentTimestamp();
+    if (now >= deadline) break;
+
+    sleep_ms = TimestampDifferenceMilliseconds(now, deadline);
+    if (what == SL_WAIT_LAG || !cv) sleep_ms = Min(sleep_ms, SL_WAIT_POLL_MS);
+
+    if (cv) {
+      ConditionVariableTimedSleep(cv, Max(sleep_ms, 1), PG_WAIT_EXTENSION);
+    } else {
+      (void) WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                       Max(sleep_ms, 1),
+                       PG_WAIT_EXTENSION);
+      ResetLatch(MyLatch);
+      CHECK_FOR_INTERRUPTS();
+    }
+  }
+
+  if (cv) ConditionVariableCancelSleep();
+
+  return done;
+}
+
+/*
+ * SQL interface
+ */
+
+PG_FUNCTION_INFO_V1(streaming_lag_wait);
+PG_FUNCTION_INFO_V1(streaming_lag_wait_lsn);
+
+/*
+ * Wait until the interpolated lag is at most max_lag. Returns false if
+ * that did not happen within timeout.
+ */
+Datum
+streaming_lag_wait(PG_FUNCTION_ARGS)
+{
+  int64 max_lag = sl_interval_usec(PG_GETARG_INTERVAL_P(0));
+  int64 timeout = sl_interval_usec(PG_GETARG_INTERVAL_P(1));
+
+  PG_RETURN_BOOL(wait_for(SL_WAIT_LAG, max_lag, InvalidXLogRecPtr, timeout));
+}
+
+/*
+ * Wait until this server has replayed the given LSN, e.g. one returned
+ * by pg_current_wal_lsn() on the primary after a write. Returns false
+ * if that did not happen within timeout.
+ */
+Datum
+streaming_lag_wait_lsn(PG_FUNCTION_ARGS)
+{
+  XLogRecPtr lsn = PG_GETARG_LSN(0);
+  int64 timeout = sl_interval_usec(PG_GETARG_INTERVAL_P(1));
+
+  PG_RETURN_BOOL(wait_for(SL_WAIT_LSN, 0, lsn, timeout));
+}
@@ -0,0 +1,222 @@
+/*
+ * sl_xlog.c
+ *
+ * Custom WAL resource manager carrying the heartbeat records. The
+ * worker emits one per tick in every mode, in table mode alongside the
+ * UPDATE. On a replica the redo routine publishes the replayed
+ * timestamp in shared memory as replay happens. Less frequently the
+ * worker also logs the round trip times to the standbys, which they use
+ * to estimate the offset of their clocks. As redo starts and ends the
+ * startup process also installs and removes the stall accounting.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "utils/timestamp.h"
+
+#include "streaming_lag.h"
+
+static void sl_xlog_startup(void);
+static void sl_xlog_cleanup(void);
+static void sl_xlog_redo(XLogReaderState *record);
+static void sl_xlog_desc(StringInfo buf, XLogReaderState *record);
+static const char *sl_xlog_identify(uint8 info);
+
+static const RmgrData sl_rmgr = {
+  .rm_name = STREAMING_LAG_RM_NAME,
+  .rm_redo = sl_xlog_redo,
+  .rm_startup = sl_xlog_startup,
+  .rm_cleanup = sl_xlog_cleanup,
+  .rm_desc = sl_xlog_desc,
+  .rm_identify = sl_xlog_identify
+};
+
+/*
+ * Register the resource manager. Must be called from _PG_init while
+ * shared_preload_libraries is processed, on the primary as well as on
+ * every replica replaying its WAL.
+ */
+void
+sl_xlog_init(void)
+{
+  RegisterCustomRmgr(RM_STREAMING_LAG_ID, &sl_rmgr);
+}
+
+/*
+ * Emit a heartbeat record. In WAL-only mode nothing but the record itself
+ * is written, no heap tuple and no transaction. Like an asynchronous
+ * commit we only nudge the WAL writer so that the record is sent out
+ * promptly without waiting for a flush. Only the worker for
+ * streaming_lag.database passes main; the heartbeats of the other
+ * databases are tracked per database only.
+ */
+XLogRecPtr
+sl_xlog_heartbeat(TimestampTz tstmp, bool main)
+{
+  xl_streaming_lag_heartbeat xlrec;
+  XLogRecPtr lsn;
+
+  xlrec.tstmp = tstmp;
+  xlrec.dbid = MyDatabaseId;
+  xlrec.tli = GetWALInsertionTimeLine();
+  xlrec.flags = main ? XLH_HEARTBEAT_MAIN : 0;
+
+  XLogBeginInsert();
+  XLogRegisterData((char *) &xlrec, SizeOfStreamingLagHeartbeat);
+  lsn = XLogInsert(RM_STREAMING_LAG_ID, XLOG_STREAMING_LAG_HEARTBEAT);
+
+  XLogSetAsyncXactLSN(lsn);
+
+  return lsn;
+}
+
+/*
+ * Log the round trip times to the standbys, so each can pick its own
+ * as it replays the record
+ */
+XLogRecPtr
+sl_xlog_rtt(const xl_streaming_lag_rtt_entry *entries, int nentries)
+{
+  xl_streaming_lag_rtt xlrec;
+
+  xlrec.nentries = nentries;
+
+  XLogBeginInsert();
+  XLogRegisterData((char *) &xlrec, SizeOfStreamingLagRtt);
+  XLogRegisterData((char *) entries,
+                   sizeof(xl_streaming_lag_rtt_entry) * nentries);
+  return XLogInsert(RM_STREAMING_LAG_ID, XLOG_STREAMING_LAG_RTT);
+}
+
+/*
+ * Log a load record carrying len bytes of data
+ */
+XLogRecPtr
+sl_xlog_load(const char *data, int len)
+{
+  xl_streaming_lag_load xlrec;
+
+  xlrec.len = len;
+
+  XLogBeginInsert();
+  XLogRegisterData((char *) &xlrec, SizeOfStreamingLagLoad);
+  XLogRegisterData((char *) data, len);
+  return XLogInsert(RM_STREAMING_LAG_ID, XLOG_STREAMING_LAG_LOAD);
+}
+
+/* the startup process times replay during stalls, see sl_stall.c */
+static void
+sl_xlog_startup(void)
+{
+  sl_stall_install();
+}
+
+static void
+sl_xlog_cleanup(void)
+{
+  sl_stall_uninstall();
+}
+
+static void
+sl_xlog_redo(XLogReaderState *record)
+{
+  uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+  switch (info) {
+  case XLOG_STREAMING_LAG_HEARTBEAT:
+    {
+      xl_streaming_lag_heartbeat *xlrec =
+        (xl_streaming_lag_heartbeat *) XLogRecGetData(record);
+      TimestampTz now = GetCurrentTimestamp();
+      int64 lag;
+      TimeLineID tli;
+
+      /*
+       * A heartbeat of an older timeline than the last one must be
+       * from a primary that was failed over, it says nothing about the
+       * current one
+       */
+      if (sl_state_get(NULL, NULL, &tli) && xlrec->tli < tli) {
+        elog(DEBUG1, "streaming_lag: heartbeat of timeline %u ignored, "
+             "already on timeline %u", xlrec->tli, tli);
+        break;
+      }
+
+      sl_database_add(xlrec->dbid, xlrec->tstmp, record->EndRecPtr, now);
+      if (!(xlrec->flags & XLH_HEARTBEAT_MAIN)) break;
+
+      sl_state_set(xlrec->tstmp, record->EndRecPtr, xlrec->tli);
+      sl_lsnmap_sample_upstream();
+      sl_clock_sample();
+      sl_rate_add(now, xlrec->tstmp, record->EndRecPtr);
+      sl_hops_add(xlrec->tstmp, record->EndRecPtr, now);
+
+      lag = now - sl_clock_correct(xlrec->tstmp);
+      sl_history_add(now, lag);
+      sl_rollup_add(now, lag);
+      sl_histogram_record(SL_HIST_LAG, lag);
+      sl_lagfile_add(now, lag, record->EndRecPtr);
+    }
+    break;
+  case XLOG_STREAMING_LAG_RTT:
+    sl_clock_set_rtt((xl_streaming_lag_rtt *) XLogRecGetData(record));
+    break;
+  case XLOG_STREAMING_LAG_LOAD:
+    break;
+  default:
+    elog(PANIC, "%s_redo: unknown op code %u", STREAMING_LAG_RM_NAME, info);
+  }
+}
+
+static void
+sl_xlog_desc(StringInfo buf, XLogReaderState *record)
+{
+  uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+  if (info == XLOG_STREAMING_LAG_HEARTBEAT) {
+    xl_streaming_lag_heartbeat *xlrec =
+      (xl_streaming_lag_heartbeat *) XLogRecGetData(record);
+
+    appendStringInfo(buf, "tstmp %s; db %u; tli %u%s",
+                     timestamptz_to_str(xlrec->tstmp), xlrec->dbid, xlrec->tli,
+                     (xlrec->flags & XLH_HEARTBEAT_MAIN) ? "; main" : "");
+  } else if (info == XLOG_STREAMING_LAG_RTT) {
+    xl_streaming_lag_rtt *xlrec =
+      (xl_streaming_lag_rtt *) XLogRecGetData(record);
+    int i;
+
+    appendStringInfo(buf, "nentries %d", xlrec->nentries);
+    for (i = 0; i < xlrec->nentries; i++)
+      appendStringInfo(buf, "; node %08x rtt %d us",
+                       xlrec->entries[i].node, xlrec->entries[i].rtt);
+  } else if (info == XLOG_STREAMING_LAG_LOAD) {
+    xl_streaming_lag_load *xlrec =
+      (xl_streaming_lag_load *) XLogRecGetData(record);
+
+    appendStringInfo(buf, "len %d", xlrec->len);
+  }
+}
+
+static const char *
+sl_xlog_identify(uint8 info)
+{
+  switch (info & ~XLR_INFO_MASK) {
+  case XLOG_STREAMING_LAG_HEARTBEAT:
+    return "HEARTBEAT";
+  case XLOG_STREAMING_LAG_RTT:
+    return "RTT";
+  case XLOG_STREAMING_LAG_LOAD:
+    return "LOAD";
+  }
+  return NULL;
+}
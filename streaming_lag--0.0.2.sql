@@ -0,0 +1,323 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION streaming_lag" to load this file. \quit
+
+DROP TABLE IF EXISTS streaming_lag_data;
+CREATE TABLE streaming_lag_data (tstmp TIMESTAMPTZ);
+
+CREATE FUNCTION streaming_lag_now()
+RETURNS TIMESTAMPTZ
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- times of the heartbeat worker; avg_* are per heartbeat written
+CREATE FUNCTION streaming_lag_worker_stats(
+    OUT ticks BIGINT,
+    OUT missed_ticks BIGINT,
+    OUT heartbeats BIGINT,
+    OUT last_tick_time INTERVAL,
+    OUT avg_tick_time INTERVAL,
+    OUT max_tick_time INTERVAL,
+    OUT avg_execute_time INTERVAL,
+    OUT avg_commit_time INTERVAL,
+    OUT last_jitter INTERVAL,
+    OUT max_jitter INTERVAL,
+    OUT wal_bytes BIGINT)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_worker_stats AS
+SELECT * FROM streaming_lag_worker_stats();
+
+CREATE FUNCTION streaming_lag_lsn_time(pg_lsn)
+RETURNS TIMESTAMPTZ
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION streaming_lag_lsn_lag(pg_lsn)
+RETURNS INTERVAL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION streaming_lag_interpolated()
+RETURNS INTERVAL
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION streaming_lag_history(
+    window_size INTERVAL DEFAULT '1 hour',
+    OUT sample_time TIMESTAMPTZ,
+    OUT lag INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION streaming_lag_stats(
+    window_size INTERVAL DEFAULT '1 hour',
+    OUT samples BIGINT,
+    OUT min INTERVAL,
+    OUT avg INTERVAL,
+    OUT p50 INTERVAL,
+    OUT p95 INTERVAL,
+    OUT p99 INTERVAL,
+    OUT max INTERVAL)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- histogram[i] counts lags of 2^(i-2) up to 2^(i-1) ms, histogram[1] < 1ms
+CREATE FUNCTION streaming_lag_rollup(
+    tier TEXT DEFAULT 'minute',
+    OUT bucket_start TIMESTAMPTZ,
+    OUT samples BIGINT,
+    OUT min INTERVAL,
+    OUT max INTERVAL,
+    OUT avg INTERVAL,
+    OUT histogram BIGINT[])
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- block until the lag is at most max_lag, false on timeout
+CREATE FUNCTION streaming_lag_wait(
+    max_lag INTERVAL,
+    timeout INTERVAL DEFAULT '1 minute')
+RETURNS BOOLEAN
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- block until the given LSN is replayed, false on timeout
+CREATE FUNCTION streaming_lag_wait_lsn(
+    lsn pg_lsn,
+    timeout INTERVAL DEFAULT '1 minute')
+RETURNS BOOLEAN
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- offset of the local clock against the primary's and its error bound
+CREATE FUNCTION streaming_lag_clock_offset(
+    OUT clock_offset INTERVAL,
+    OUT error INTERVAL,
+    OUT samples INT)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- network_lag + apply_lag = total_lag
+CREATE FUNCTION streaming_lag_components(
+    OUT network_lag INTERVAL,
+    OUT apply_lag INTERVAL,
+    OUT total_lag INTERVAL)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- replay throughput of a replica and the estimated time to catch up
+-- catch_up_time is NULL while replay_speed is at most 1.01 or no heartbeat
+-- has been replayed for 3 of the primary's heartbeat intervals
+CREATE FUNCTION streaming_lag_replay_rate(
+    OUT bytes_per_second DOUBLE PRECISION,
+    OUT replay_speed DOUBLE PRECISION,
+    OUT catch_up_time INTERVAL)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- timeline the latest heartbeat was written on
+CREATE FUNCTION streaming_lag_timeline()
+RETURNS BIGINT
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- the table is only read if shared memory knows no heartbeat yet
+CREATE OR REPLACE VIEW streaming_lag AS
+SELECT clock_timestamp() - coalesce(streaming_lag_now(),
+                                    (SELECT tstmp FROM streaming_lag_data))
+       AS lag,
+       streaming_lag_timeline() AS timeline;
+
+-- the interpolated lag, its parts and the time to catch up; unlike the
+-- streaming_lag view these take spinlocks, so leave them to dashboards
+CREATE VIEW streaming_lag_details AS
+SELECT c.total_lag AS interpolated_lag,
+       c.network_lag,
+       c.apply_lag,
+       r.catch_up_time
+  FROM streaming_lag_components() c, streaming_lag_replay_rate() r;
+
+-- the non-empty buckets of a log-linear histogram; upper is NULL for
+-- the open-ended last bucket
+CREATE FUNCTION streaming_lag_histogram_data(
+    histogram TEXT DEFAULT 'lag',
+    OUT lower INTERVAL,
+    OUT upper INTERVAL,
+    OUT count BIGINT,
+    OUT cumulative DOUBLE PRECISION)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION streaming_lag_histogram_reset(histogram TEXT DEFAULT 'lag')
+RETURNS VOID
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- the histograms are shared by all sessions
+REVOKE ALL ON FUNCTION streaming_lag_histogram_reset(TEXT) FROM PUBLIC;
+
+CREATE VIEW streaming_lag_histogram AS
+SELECT * FROM streaming_lag_histogram_data('lag');
+
+-- lag of every directly connected standby, by the clock of this server
+CREATE VIEW streaming_lag_standbys AS
+SELECT pid, application_name, client_addr, state, sync_state,
+       streaming_lag_lsn_lag(write_lsn) AS write_lag,
+       streaming_lag_lsn_lag(flush_lsn) AS flush_lag,
+       streaming_lag_lsn_lag(replay_lsn) AS replay_lag
+  FROM pg_stat_replication;
+
+-- latest heartbeat of every database written in
+CREATE FUNCTION streaming_lag_databases(
+    OUT datid OID,
+    OUT heartbeat TIMESTAMPTZ,
+    OUT lsn PG_LSN,
+    OUT heartbeats BIGINT,
+    OUT lag INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- lag samples of one database within the given window
+CREATE FUNCTION streaming_lag_database_history(
+    datid OID,
+    since INTERVAL DEFAULT '5 minutes',
+    OUT sample_time TIMESTAMPTZ,
+    OUT lag INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_databases AS
+SELECT s.datid, d.datname, s.heartbeat, s.lsn, s.heartbeats, s.lag
+  FROM streaming_lag_databases() s
+  LEFT JOIN pg_database d ON d.oid = s.datid;
+
+-- lag of the latest heartbeat up to the upstream server and from there
+CREATE FUNCTION streaming_lag_hops(
+    OUT hop INTEGER,
+    OUT from_node TEXT,
+    OUT to_node TEXT,
+    OUT lag INTERVAL,
+    OUT p50 INTERVAL,
+    OUT p99 INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_hops AS
+SELECT * FROM streaming_lag_hops();
+
+-- write WAL at a given rate on the master, for calibrating replicas
+CREATE FUNCTION streaming_lag_generate_load(
+    bytes_per_second BIGINT,
+    duration INTERVAL DEFAULT '1 minute',
+    record_size INTEGER DEFAULT 1024,
+    fpi_ratio DOUBLE PRECISION DEFAULT 0,
+    OUT records BIGINT,
+    OUT fpis BIGINT,
+    OUT bytes BIGINT,
+    OUT missed_bytes BIGINT,
+    OUT elapsed INTERVAL)
+RETURNS RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION
+    streaming_lag_generate_load(BIGINT, INTERVAL, INTEGER, DOUBLE PRECISION)
+    FROM PUBLIC;
+
+-- heartbeats for logical replication, one row per publishing server
+CREATE TABLE streaming_lag_logical (
+    origin TEXT PRIMARY KEY,
+    tstmp TIMESTAMPTZ NOT NULL);
+
+CREATE FUNCTION streaming_lag_logical_apply()
+RETURNS TRIGGER
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE TRIGGER streaming_lag_logical_apply
+    AFTER INSERT OR UPDATE ON streaming_lag_logical
+    FOR EACH ROW EXECUTE FUNCTION streaming_lag_logical_apply();
+
+-- apply workers run with session_replication_role = replica
+ALTER TABLE streaming_lag_logical
+    ENABLE ALWAYS TRIGGER streaming_lag_logical_apply;
+
+-- latest heartbeat applied by every subscription, per origin
+CREATE FUNCTION streaming_lag_subscriptions(
+    OUT subid OID,
+    OUT subname TEXT,
+    OUT origin TEXT,
+    OUT heartbeat TIMESTAMPTZ,
+    OUT applied TIMESTAMPTZ,
+    OUT heartbeats BIGINT,
+    OUT apply_lag INTERVAL,
+    OUT lag INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_subscriptions AS
+SELECT * FROM streaming_lag_subscriptions();
+
+-- replayed heartbeats kept in the lag file, see streaming_lag.lag_file_size
+CREATE FUNCTION streaming_lag_lag_file(
+    since INTERVAL DEFAULT '1 hour',
+    OUT sample_time TIMESTAMPTZ,
+    OUT lag INTERVAL,
+    OUT lsn PG_LSN)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- replay stalls of a slave, see streaming_lag.stall_threshold
+CREATE FUNCTION streaming_lag_stalls(
+    OUT stall BIGINT,
+    OUT started TIMESTAMPTZ,
+    OUT ended TIMESTAMPTZ,
+    OUT duration INTERVAL,
+    OUT max_lag INTERVAL,
+    OUT heartbeats BIGINT,
+    OUT replay INTERVAL,
+    OUT io_wait INTERVAL,
+    OUT conflict_wait INTERVAL,
+    OUT wal_wait INTERVAL,
+    OUT delay INTERVAL,
+    OUT other INTERVAL,
+    OUT records BIGINT,
+    OUT bytes BIGINT,
+    OUT fpis BIGINT,
+    OUT cause TEXT,
+    OUT top_rmgr TEXT,
+    OUT ongoing BOOLEAN)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_stalls AS
+SELECT * FROM streaming_lag_stalls();
+
+CREATE FUNCTION streaming_lag_stall_rmgrs(
+    OUT stall BIGINT,
+    OUT rmgr TEXT,
+    OUT records BIGINT,
+    OUT bytes BIGINT,
+    OUT fpis BIGINT,
+    OUT redo_time INTERVAL)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW streaming_lag_stall_rmgrs AS
+SELECT * FROM streaming_lag_stall_rmgrs();
@@ -12,40 +12,143 @@
 
 #include "postgres.h"
 
+#include <signal.h>
+
 /* Following are required for all bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
+#include "storage/pmsignal.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "access/commit_ts.h"
+#include "access/heapam.h"
+#include "access/table.h"
+#include "access/tableam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
+#include "executor/tuptable.h"
 #include "fmgr.h"
 #include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
 #include "pgstat.h"
+#include "replication/syncrep.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "portability/instr_time.h"
+#include "storage/bufmgr.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
 #include "tcop/utility.h"
 
-#include <sys/time.h>
+#include "streaming_lag.h"
 
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
+PGDLLEXPORT void streaming_lag_main(Datum main_arg);
+
+/*
+ * false in the workers for the databases in streaming_lag.databases,
+ * which only write heartbeats
+ */
+static bool is_main = true;
+static uint32 launcher = 0;     /* generation of the main worker */
 
 /* flags set by signal handlers */
-static volatile sig_atomic_t got_sigalrm = false;
 static volatile sig_atomic_t got_sigterm = false;
 static volatile sig_atomic_t got_sighup  = false;
 
 /* GUC variables */
 static char *guc_database = NULL;
+static char *guc_databases = NULL;
 static char *guc_schema   = NULL;
 static int  guc_precision = 0;
+static int  guc_min_precision = 0;
+static int  guc_mode      = SL_MODE_TABLE;
+int         guc_lsn_map_size = 0;
+int         guc_history_size = 0;
+int         guc_rollup_seconds = 0;
+int         guc_rollup_minutes = 0;
+int         guc_rollup_hours   = 0;
+char       *guc_node_name = NULL;
+bool        guc_clock_correction = false;
+bool        guc_skip_when_busy = false;
+static bool guc_logical = false;
+static int  guc_flush_probe = 0;
+static int  guc_sync_probe = 0;
+static int  guc_sync_probe_level = SYNC_REP_WAIT_APPLY;
+int         guc_max_staleness = 0;
+int         guc_metrics_port = 0;
+char       *guc_metrics_address = NULL;
+int         guc_health_port = 0;
+int         guc_health_max_lag = 0;
+int         guc_max_databases = 0;
+int         guc_lag_file_size = 0;
+int         guc_stall_threshold = 0;
+
+/*
+ * The heartbeat UPDATE is planned once and the plan is kept in the plan
+ * cache, which replans it on invalidation. NULL means it is prepared
+ * at the next tick, which is what a SIGHUP asks for.
+ */
+static SPIPlanPtr update_plan = NULL;
+
+/*
+ * With streaming_lag.logical on, the same transaction also upserts the
+ * row of this server in streaming_lag_logical, for subscribers
+ */
+static char *logical_cmd = NULL;
+static SPIPlanPtr logical_plan = NULL;
+
+/*
+ * In heap mode the heartbeat tuple is updated in place of the executor.
+ * The relation is resolved once, the tuple is remembered by its TID. An
+ * invalid TID means it has to be looked up by a scan.
+ */
+static Oid data_relid = InvalidOid;
+static ItemPointerData data_tid;
+
+/*
+ * How often the round trip times to the standbys are logged for their
+ * clock offset estimates
+ */
+#define RTT_INTERVAL_MS 10000
+
+#define RTT_QUERY \
+  "SELECT application_name, " \
+  "       (extract(epoch FROM write_lag) * 1000000)::int8 " \
+  "  FROM pg_catalog.pg_stat_replication " \
+  " WHERE application_name IS NOT NULL"
+
+static TimestampTz last_rtt = 0;
+
+static const struct config_enum_entry sync_probe_options[] = {
+  {"remote_write", SYNC_REP_WAIT_WRITE, false},
+  {"on",           SYNC_REP_WAIT_FLUSH, false},
+  {"remote_apply", SYNC_REP_WAIT_APPLY, false},
+  {NULL, 0, false}
+};
+
+static const struct config_enum_entry mode_options[] = {
+  {"table", SL_MODE_TABLE, false},
+  {"heap",  SL_MODE_HEAP,  false},
+  {"wal",   SL_MODE_WAL,   false},
+  {NULL, 0, false}
+};
 
 static void
 log_info(char *msg) {
@@ -58,7 +161,7 @@ sigterm(SIGNAL_ARGS)
   int save_errno = errno;
 
   got_sigterm = true;
-  if (MyProc) SetLatch(&MyProc->procLatch);
+  SetLatch(MyLatch);
 
   errno = save_errno;
 }
@@ -69,20 +172,161 @@ sighup(SIGNAL_ARGS)
   int save_errno = errno;
 
   got_sighup = true;
-  if (MyProc) SetLatch(&MyProc->procLatch);
+  SetLatch(MyLatch);
 
   errno = save_errno;
 }
 
+/*
+ * Tick scheduler
+ *
+ * Heartbeats are due at fixed multiples of streaming_lag.precision from
+ * the start of the schedule, so neither the time a heartbeat takes nor
+ * a late wakeup shifts the following ones. A worker that falls behind by
+ * more than one interval coalesces the missed ticks into one. How late
+ * each tick fires is recorded as scheduling jitter.
+ */
+
+static TimestampTz next_tick = 0;       /* 0 if there is no schedule */
+static int scheduled_precision = 0;     /* current interval */
+static int configured_precision = 0;    /* streaming_lag.precision it is for */
+
 static void
-sigalrm(SIGNAL_ARGS)
+schedule_reset(void)
 {
-  int save_errno = errno;
+  configured_precision = guc_precision;
+  scheduled_precision = guc_precision;
+  next_tick = guc_precision > 0
+    ? TimestampTzPlusMilliseconds(GetCurrentTimestamp(), guc_precision)
+    : 0;
+}
+
+/* milliseconds until the next tick, -1 if there is none */
+static long
+schedule_timeout(void)
+{
+  if (next_tick == 0) return -1;
 
-  got_sigalrm = true;
-  if (MyProc) SetLatch(&MyProc->procLatch);
+  return TimestampDifferenceMilliseconds(GetCurrentTimestamp(), next_tick);
+}
 
-  errno = save_errno;
+/* returns true if a tick is due and advances the schedule past now */
+static bool
+schedule_due(void)
+{
+  TimestampTz now;
+  int64 interval;
+  int64 late;
+  int64 missed;
+
+  if (next_tick == 0) return false;
+
+  now = GetCurrentTimestamp();
+  if (now < next_tick) return false;
+
+  interval = (int64) scheduled_precision * 1000;
+  late = now - next_tick;
+  missed = late / interval;
+  next_tick += (missed + 1) * interval;
+
+  if (is_main) sl_stats_tick(late, missed);
+
+  if (missed > 0) {
+    ereport(DEBUG1, (errmsg("%s: coalesced " INT64_FORMAT " missed ticks",
+                            MyBgworkerEntry->bgw_name, missed)));
+  }
+
+  return true;
+}
+
+/*
+ * Move the next tick to interval milliseconds after the one that just
+ * fired, and keep that interval from then on
+ */
+static void
+schedule_interval(int interval)
+{
+  if (next_tick == 0 || interval == scheduled_precision) return;
+
+  next_tick += (int64) (interval - scheduled_precision) * 1000;
+  scheduled_precision = interval;
+}
+
+/*
+ * Adaptive precision
+ *
+ * With streaming_lag.min_precision set, the interval moves between it
+ * and streaming_lag.precision. It is halved at every tick that finds a
+ * standby's replay lag (as the walsenders measure it) at least doubled
+ * or at least as large as the interval, or a burst of WAL of at least
+ * twice the average rate. Otherwise it grows by a quarter.
+ */
+
+#define ADAPT_MIN_BURST 65536   /* bytes per tick below which there is none */
+
+static XLogRecPtr adapt_lsn = InvalidXLogRecPtr;
+static double adapt_wal_avg = 0;        /* bytes per tick */
+static int64 adapt_lag = 0;
+
+/* the largest replay lag of all standbys in microseconds */
+static int64
+standby_max_lag(void)
+{
+  int64 max_lag = 0;
+  int i;
+
+  for (i = 0; i < max_wal_senders; i++) {
+    WalSnd *walsnd = &WalSndCtl->walsnds[i];
+    pid_t pid;
+    TimeOffset lag;
+
+    SpinLockAcquire(&walsnd->mutex);
+    pid = walsnd->pid;
+    lag = walsnd->replayLag;
+    SpinLockRelease(&walsnd->mutex);
+
+    if (pid != 0 && lag > max_lag) max_lag = lag;
+  }
+
+  return max_lag;
+}
+
+static void
+adapt_precision(void)
+{
+  XLogRecPtr lsn = GetXLogInsertRecPtr();
+  int64 lag = standby_max_lag();
+  int interval = scheduled_precision;
+  bool hot = false;
+
+  if (guc_min_precision <= 0 || guc_min_precision >= guc_precision) {
+    schedule_interval(guc_precision);
+    adapt_lsn = InvalidXLogRecPtr;
+    return;
+  }
+
+  if (!XLogRecPtrIsInvalid(adapt_lsn)) {
+    double bytes = (double) (lsn - adapt_lsn);
+
+    if (bytes >= ADAPT_MIN_BURST && bytes >= 2 * adapt_wal_avg) hot = true;
+    adapt_wal_avg += (bytes - adapt_wal_avg) / 16;
+  }
+
+  if (lag >= (int64) interval * 1000 ||
+      (lag > 2 * adapt_lag && lag >= (int64) guc_min_precision * 1000))
+    hot = true;
+
+  adapt_lsn = lsn;
+  adapt_lag = lag;
+
+  if (hot) interval = Max(interval / 2, guc_min_precision);
+  else interval = Min(interval + Max(interval / 4, 1), guc_precision);
+
+  if (interval != scheduled_precision) {
+    ereport(DEBUG1, (errmsg("%s: interval now %d ms",
+                            MyBgworkerEntry->bgw_name, interval)));
+    schedule_interval(interval);
+  }
 }
 
 /*
@@ -94,11 +338,16 @@ static void
 initialize_objects(void)
 {
   int ret;
-  int ntup;
+  int64 ntup;
   bool isnull;
   StringInfoData buf;
+  static const char *schema = NULL;
 
-  guc_schema = (char*)quote_identifier(guc_schema);
+  /* only once, this is retried after errors */
+  if (schema == NULL) {
+    schema = guc_schema;
+    guc_schema = (char*)quote_identifier(guc_schema);
+  }
 
   SetCurrentStatementStartTimestamp();
   StartTransactionCommand();
@@ -118,32 +367,36 @@ initialize_objects(void)
 
   ret = SPI_execute(buf.data, false, 0);
   if (ret != SPI_OK_SELECT) {
-    ereport(FATAL, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
+    ereport(ERROR, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
   }
 
   /* This should never happen */
   if (SPI_processed != 1) {
-    ereport(FATAL, (errmsg("%s: got %d rows from a 'SELECT count()'",
+    ereport(ERROR, (errmsg("%s: got " UINT64_FORMAT " rows from a 'SELECT count()'",
                            MyBgworkerEntry->bgw_name, SPI_processed)));
   }
 
-  ntup = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+  ntup = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
                                      SPI_tuptable->tupdesc,
                                      1, &isnull));
 
   /* This should never happen */
   if (isnull) {
-    ereport(FATAL, (errmsg("%s: 'SELECT count()' returns NULL",
+    ereport(ERROR, (errmsg("%s: 'SELECT count()' returns NULL",
                            MyBgworkerEntry->bgw_name)));
   }
 
   if (ntup == 0) {
-    ereport(FATAL, (errmsg("%s: table %s.streaming_lag_data not found",
+    ereport(ERROR, (errmsg("%s: table %s.streaming_lag_data not found",
                            MyBgworkerEntry->bgw_name, guc_schema),
                     errhint("'streaming_lag.schema' must match the SCHEMA option "
                             "at CREATE EXTENSION time")));
   }
 
+  data_relid = get_relname_relid("streaming_lag_data",
+                                 get_namespace_oid(schema, false));
+  ItemPointerSetInvalid(&data_tid);
+
   resetStringInfo(&buf);
   appendStringInfo(&buf,
                    "DELETE FROM %s.streaming_lag_data",
@@ -151,7 +404,7 @@ initialize_objects(void)
 
   ret = SPI_execute(buf.data, false, 0);
   if (ret != SPI_OK_DELETE) {
-    ereport(FATAL, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
+    ereport(ERROR, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
   }
 
   resetStringInfo(&buf);
@@ -160,7 +413,7 @@ initialize_objects(void)
                    guc_schema);
   ret = SPI_execute(buf.data, false, 0);
   if (ret != SPI_OK_INSERT) {
-    ereport(FATAL, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
+    ereport(ERROR, (errmsg("%s: SPI error code %d", MyBgworkerEntry->bgw_name, ret)));
   }
 
   SPI_finish();
@@ -171,135 +424,966 @@ initialize_objects(void)
   log_info("initialized, database objects validated");
 }
 
+static SPIPlanPtr
+prepare_update(const char *update_cmd)
+{
+  SPIPlanPtr plan;
+
+  plan = SPI_prepare(update_cmd, 0, NULL);
+  if (plan == NULL) {
+    ereport(ERROR, (errmsg("%s: cannot prepare \"%s\": %s",
+                           MyBgworkerEntry->bgw_name, update_cmd,
+                           SPI_result_code_string(SPI_result))));
+  }
+
+  if (SPI_keepplan(plan) != 0) {
+    ereport(ERROR, (errmsg("%s: cannot keep plan of \"%s\"",
+                           MyBgworkerEntry->bgw_name, update_cmd)));
+  }
+
+  return plan;
+}
+
+/*
+ * Find the heartbeat tuple by a scan and remember its TID
+ */
+static bool
+locate_data_tuple(Relation rel, Snapshot snapshot, TupleTableSlot *slot)
+{
+  TableScanDesc scan;
+  bool found;
+
+  scan = table_beginscan(rel, snapshot, 0, NULL);
+  found = table_scan_getnextslot(scan, ForwardScanDirection, slot);
+  if (found) ItemPointerCopy(&slot->tts_tid, &data_tid);
+  table_endscan(scan);
+
+  return found;
+}
+
+/*
+ * Update the heartbeat tuple through the table AM, bypassing SPI and the
+ * executor. The table has no indexes, hence the update never needs index
+ * maintenance and stays on the page as a HOT update as long as the page
+ * has room. Since nothing scans the table anymore, we give the page the
+ * chance to be pruned each time, like a sequential scan would.
+ *
+ * Returns false if the caller has to fall back to the SPI UPDATE: the
+ * remembered tuple is gone or was updated by someone else, or the table
+ * has grown indexes or triggers that only the executor takes care of.
+ */
+static bool
+update_data_direct(TimestampTz tstmp)
+{
+  Relation rel;
+  TupleDesc tupdesc;
+  TupleTableSlot *oldslot;
+  TupleTableSlot *newslot;
+  Snapshot snapshot = GetActiveSnapshot();
+  TM_Result result;
+  TM_FailureData tmfd;
+  LockTupleMode lockmode;
+#if PG_VERSION_NUM >= 160000
+  TU_UpdateIndexes update_indexes;
+#else
+  bool update_indexes;
+#endif
+  int i;
+
+  if (!OidIsValid(data_relid)) return false;
+
+  rel = table_open(data_relid, RowExclusiveLock);
+  if (rel->trigdesc != NULL || RelationGetIndexList(rel) != NIL) {
+    table_close(rel, RowExclusiveLock);
+    return false;
+  }
+
+  tupdesc = RelationGetDescr(rel);
+  oldslot = table_slot_create(rel, NULL);
+  newslot = table_slot_create(rel, NULL);
+
+  if (!ItemPointerIsValid(&data_tid)) {
+    result = locate_data_tuple(rel, snapshot, oldslot) ? TM_Ok : TM_Invisible;
+  } else {
+    if (rel->rd_rel->relam == HEAP_TABLE_AM_OID) {
+      Buffer buf = ReadBuffer(rel, ItemPointerGetBlockNumber(&data_tid));
+
+      heap_page_prune_opt(rel, buf);
+      ReleaseBuffer(buf);
+    }
+
+    result = table_tuple_fetch_row_version(rel, &data_tid, snapshot, oldslot)
+      ? TM_Ok : TM_Invisible;
+  }
+
+  if (result == TM_Ok) {
+    slot_getallattrs(oldslot);
+
+    ExecClearTuple(newslot);
+    for (i = 0; i < tupdesc->natts; i++) {
+      newslot->tts_values[i] = oldslot->tts_values[i];
+      newslot->tts_isnull[i] = oldslot->tts_isnull[i];
+    }
+    newslot->tts_values[0] = TimestampTzGetDatum(tstmp);
+    newslot->tts_isnull[0] = false;
+    ExecStoreVirtualTuple(newslot);
+
+    result = table_tuple_update(rel, &data_tid, newslot,
+                                GetCurrentCommandId(true), snapshot,
+                                InvalidSnapshot, true, &tmfd, &lockmode,
+                                &update_indexes);
+  }
+
+  if (result == TM_Ok) {
+    ItemPointerCopy(&newslot->tts_tid, &data_tid);
+#if PG_VERSION_NUM >= 160000
+    if (update_indexes != TU_None)
+#else
+    if (update_indexes)
+#endif
+      ereport(DEBUG1, (errmsg("%s: heartbeat update was not HOT",
+                              MyBgworkerEntry->bgw_name)));
+  } else {
+    ItemPointerSetInvalid(&data_tid);
+  }
+
+  ExecDropSingleTupleTableSlot(oldslot);
+  ExecDropSingleTupleTableSlot(newslot);
+  table_close(rel, RowExclusiveLock);
+
+  return result == TM_Ok;
+}
+
 static void
-my_main(Datum main_arg)
+forget_update_plan(void)
 {
-  StringInfoData buf;
-  struct itimerval timer;
-  int rc;
+  if (update_plan) {
+    SPI_freeplan(update_plan);
+    update_plan = NULL;
+  }
+  if (logical_plan) {
+    SPI_freeplan(logical_plan);
+    logical_plan = NULL;
+  }
+}
 
-  timer.it_value.tv_sec = guc_precision/1000;
-  timer.it_value.tv_usec = (guc_precision%1000)*1000;
-  timer.it_interval.tv_sec = timer.it_value.tv_sec;
-  timer.it_interval.tv_usec = timer.it_value.tv_usec;
+/*
+ * Make a heartbeat known on this server, as replay does on a replica
+ */
+static void
+publish(TimestampTz tstmp, XLogRecPtr lsn)
+{
+  if (is_main) sl_state_set(tstmp, lsn, GetWALInsertionTimeLine());
+  sl_database_add(MyDatabaseId, tstmp, lsn, GetCurrentTimestamp());
+}
 
-  pqsignal(SIGTERM, sigterm);
-  pqsignal(SIGHUP,  sighup);
-  pqsignal(SIGALRM, sigalrm);
+/*
+ * The key of this server's rows in streaming_lag_logical. Unlike the
+ * node name it falls back to the system identifier, as every unnamed
+ * publisher would share the WAL receiver's default.
+ */
+static const char *
+origin_name(void)
+{
+  const char *name = sl_clock_given_name();
 
-  /* We're now ready to receive signals */
-  BackgroundWorkerUnblockSignals();
+  return name ? name : psprintf(UINT64_FORMAT, GetSystemIdentifier());
+}
 
-  /* Connect to database */
-  BackgroundWorkerInitializeConnection(guc_database, NULL);
+/*
+ * Flush probe
+ *
+ * Heartbeats are committed asynchronously, so their cost never shows
+ * how long the WAL takes to reach the disk. Every
+ * streaming_lag.flush_probe_interval heartbeats the worker waits for
+ * the WAL up to its record to be flushed, by itself or the WAL writer
+ * it just woke, and records the wait in the flush histogram.
+ */
 
-  /* Verify expected objects exist */
-  initialize_objects();
+static int probe_countdown = 0;
+
+static void
+probe_flush(XLogRecPtr lsn)
+{
+  instr_time start;
+  instr_time elapsed;
+
+  if (guc_flush_probe <= 0 || !is_main) return;
+  if (--probe_countdown > 0) return;
+  probe_countdown = guc_flush_probe;
+
+  INSTR_TIME_SET_CURRENT(start);
+  XLogFlush(lsn);
+  INSTR_TIME_SET_CURRENT(elapsed);
+  INSTR_TIME_SUBTRACT(elapsed, start);
+
+  sl_histogram_record(SL_HIST_FLUSH, INSTR_TIME_GET_MICROSEC(elapsed));
+}
+
+/*
+ * Synchronous replication probe
+ *
+ * Every streaming_lag.sync_probe_interval heartbeats the worker flushes
+ * its commit, notes where it ends and then, without waiting, watches the
+ * position the synchronous standbys have confirmed at
+ * streaming_lag.sync_probe_level. The time until that passes the
+ * commit, the commit to visible latency with remote_apply, goes into
+ * the sync histogram. Meanwhile the worker polls, the heartbeats keep
+ * their schedule. The poll backs off from SYNC_POLL_MS to
+ * SYNC_POLL_MAX_MS as a 1/SYNC_POLL_DIV of the time waited so far,
+ * which bounds the error of a probe to as much and keeps a standby that
+ * does not answer from waking the worker more than a few hundred times.
+ * A probe not confirmed within SYNC_PROBE_TIMEOUT_MS is dropped.
+ */
+
+#define SYNC_POLL_MS 1
+#define SYNC_POLL_MAX_MS 100
+#define SYNC_POLL_DIV 16
+#define SYNC_PROBE_TIMEOUT_MS 60000
+
+static int sync_countdown = 0;
+static XLogRecPtr sync_lsn = InvalidXLogRecPtr; /* pending probe, if valid */
+static instr_time sync_start;
+
+static void
+probe_sync_start(XLogRecPtr lsn, instr_time start)
+{
+  if (guc_sync_probe <= 0 || !is_main) return;
+  if (!XLogRecPtrIsInvalid(sync_lsn)) return;
+  if (--sync_countdown > 0) return;
+  sync_countdown = guc_sync_probe;
+
+  if (!WalSndCtl->sync_standbys_defined) {
+    ereport(DEBUG1, (errmsg("%s: no synchronous standbys, sync probe skipped",
+                            MyBgworkerEntry->bgw_name)));
+    return;
+  }
+
+  /* like a synchronous commit, which flushes before it waits */
+  XLogFlush(lsn);
+
+  sync_lsn = lsn;
+  sync_start = start;
+}
+
+static void
+probe_sync_check(void)
+{
+  XLogRecPtr confirmed;
+  instr_time elapsed;
+
+  if (XLogRecPtrIsInvalid(sync_lsn)) return;
+
+  LWLockAcquire(SyncRepLock, LW_SHARED);
+  confirmed = WalSndCtl->lsn[guc_sync_probe_level];
+  LWLockRelease(SyncRepLock);
+
+  INSTR_TIME_SET_CURRENT(elapsed);
+  INSTR_TIME_SUBTRACT(elapsed, sync_start);
+
+  if (confirmed >= sync_lsn) {
+    sl_histogram_record(SL_HIST_SYNC, INSTR_TIME_GET_MICROSEC(elapsed));
+    sync_lsn = InvalidXLogRecPtr;
+  } else if (INSTR_TIME_GET_MILLISEC(elapsed) > SYNC_PROBE_TIMEOUT_MS) {
+    ereport(DEBUG1, (errmsg("%s: sync probe not confirmed in time, dropped",
+                            MyBgworkerEntry->bgw_name)));
+    sync_lsn = InvalidXLogRecPtr;
+  }
+}
+
+/* milliseconds until a pending sync probe is checked again */
+static long
+probe_sync_poll(void)
+{
+  instr_time elapsed;
+
+  INSTR_TIME_SET_CURRENT(elapsed);
+  INSTR_TIME_SUBTRACT(elapsed, sync_start);
+
+  return Min(Max((long) INSTR_TIME_GET_MILLISEC(elapsed) / SYNC_POLL_DIV,
+                 SYNC_POLL_MS),
+             SYNC_POLL_MAX_MS);
+}
+
+/*
+ * Write one heartbeat according to streaming_lag.mode
+ */
+static void
+heartbeat(const char *update_cmd)
+{
+  int rc;
+  TimestampTz tstmp;
+  XLogRecPtr lsn;
+  uint64 wal_bytes = pgWalUsage.wal_bytes;
+  instr_time start;
+  instr_time exec_start;
+  instr_time exec_time;
+  instr_time commit_start;
+  instr_time commit_time;
+  instr_time tick_time;
+
+  INSTR_TIME_SET_CURRENT(start);
+
+  if (guc_mode == SL_MODE_WAL) {
+    TimestampTz now = GetCurrentTimestamp();
+
+    lsn = sl_xlog_heartbeat(now, is_main);
+    probe_flush(lsn);
+    probe_sync_start(lsn, start);
+    publish(now, lsn);
+
+    INSTR_TIME_SET_CURRENT(tick_time);
+    INSTR_TIME_SUBTRACT(tick_time, start);
+    if (is_main) {
+      sl_stats_heartbeat(INSTR_TIME_GET_MICROSEC(tick_time), 0, 0,
+                         pgWalUsage.wal_bytes - wal_bytes);
+    }
+    ereport(DEBUG1, (errmsg("%s: tick took %.3f ms",
+                            MyBgworkerEntry->bgw_name,
+                            INSTR_TIME_GET_MILLISEC(tick_time))));
+    return;
+  }
 
   SetCurrentStatementStartTimestamp();
   StartTransactionCommand();
   SPI_connect();
   PushActiveSnapshot(GetTransactionSnapshot());
-  pgstat_report_activity(STATE_RUNNING, buf.data);
+  pgstat_report_activity(STATE_RUNNING, update_cmd);
 
-  rc = SPI_execute("SET synchronous_commit TO off", false, 0);
-  if (rc != SPI_OK_UTILITY) {
-    ereport(FATAL, (errmsg("%s: cannot SET synchronous_commit TO off: error code %d",
-                           MyBgworkerEntry->bgw_name, rc)));
+  /* that is what now() returns to the UPDATE */
+  tstmp = GetCurrentTransactionStartTimestamp();
+
+  INSTR_TIME_SET_CURRENT(exec_start);
+
+  if (guc_mode != SL_MODE_HEAP || !update_data_direct(tstmp)) {
+    if (update_plan == NULL) update_plan = prepare_update(update_cmd);
+
+    rc = SPI_execute_plan(update_plan, NULL, NULL, false, 0);
+    if (rc != SPI_OK_UPDATE) {
+      ereport(ERROR, (errmsg("%s: cannot update timestamp: error code %d",
+                             MyBgworkerEntry->bgw_name, rc)));
+    }
   }
 
+  if (guc_logical) {
+    if (logical_plan == NULL) logical_plan = prepare_update(logical_cmd);
+
+    rc = SPI_execute_plan(logical_plan, NULL, NULL, false, 0);
+    if (rc != SPI_OK_INSERT) {
+      ereport(ERROR, (errmsg("%s: cannot update logical heartbeat: error code %d",
+                             MyBgworkerEntry->bgw_name, rc)));
+    }
+  }
+
+  INSTR_TIME_SET_CURRENT(exec_time);
+  INSTR_TIME_SUBTRACT(exec_time, exec_start);
+
+  /*
+   * The record tells replicas about the new value as it is replayed, so
+   * they need not read the table.
+   */
+  lsn = sl_xlog_heartbeat(tstmp, is_main);
+  probe_flush(lsn);
+
+  INSTR_TIME_SET_CURRENT(commit_start);
+
   SPI_finish();
   PopActiveSnapshot();
   CommitTransactionCommand();
   pgstat_report_activity(STATE_IDLE, NULL);
 
-  initStringInfo(&buf);
-  appendStringInfo(&buf,
-                   "UPDATE %s.streaming_lag_data SET tstmp=now()",
-                   guc_schema);
-
-  if (setitimer(ITIMER_REAL, &timer, NULL) == -1)
-    ereport(FATAL, (errmsg("%s: cannot start timer", MyBgworkerEntry->bgw_name)));
+  INSTR_TIME_SET_CURRENT(commit_time);
+  INSTR_TIME_SUBTRACT(commit_time, commit_start);
 
-  while (!got_sigterm) {
-    rc = WaitLatch(&MyProc->procLatch,
-                   WL_LATCH_SET | WL_POSTMASTER_DEATH,
-                   -1);
-    ResetLatch(&MyProc->procLatch);
+  probe_sync_start(XactLastCommitEnd, commit_start);
 
-    /* emergency bailout if postmaster has died */
-    if (rc & WL_POSTMASTER_DEATH) proc_exit(1);
+  publish(tstmp, lsn);
 
-    if (got_sighup) {
-      got_sighup = false;
-      ProcessConfigFile(PGC_SIGHUP);
-      
-      timer.it_value.tv_sec = guc_precision/1000;
-      timer.it_value.tv_usec = (guc_precision%1000)*1000;
-      timer.it_interval.tv_sec = timer.it_value.tv_sec;
-      timer.it_interval.tv_usec = timer.it_value.tv_usec;
-
-      if (setitimer(ITIMER_REAL, &timer, NULL) == -1)
-        ereport(FATAL, (errmsg("%s: cannot start timer", MyBgworkerEntry->bgw_name)));
-    }
+  INSTR_TIME_SET_CURRENT(tick_time);
+  INSTR_TIME_SUBTRACT(tick_time, start);
+  if (is_main) {
+    sl_stats_heartbeat(INSTR_TIME_GET_MICROSEC(tick_time),
+                       INSTR_TIME_GET_MICROSEC(exec_time),
+                       INSTR_TIME_GET_MICROSEC(commit_time),
+                       pgWalUsage.wal_bytes - wal_bytes);
+  }
+  ereport(DEBUG1, (errmsg("%s: tick took %.3f ms, execute %.3f ms, commit %.3f ms",
+                          MyBgworkerEntry->bgw_name,
+                          INSTR_TIME_GET_MILLISEC(tick_time),
+                          INSTR_TIME_GET_MILLISEC(exec_time),
+                          INSTR_TIME_GET_MILLISEC(commit_time))));
+}
 
-    if (got_sigalrm) {
-      got_sigalrm = false;
+/*
+ * Idle detection
+ *
+ * With streaming_lag.skip_when_busy on, a tick writes no heartbeat if
+ * the primary was not quiet since the previous one. With
+ * track_commit_timestamp on, that means some other transaction
+ * committed meanwhile. Replicas take the primary's time from the commit
+ * records they replay then. Otherwise any WAL written by somebody else
+ * counts, which is cruder: the replicas' interpolated lag follows it
+ * through the WAL receiver's send times, but WAL without commits does
+ * not advance their heartbeat lag. So then no two ticks in a row are
+ * skipped, and a vacuum or bulk load makes the lag of a replica that
+ * keeps up climb by one interval at most.
+ */
 
-      SetCurrentStatementStartTimestamp();
-      StartTransactionCommand();
-      SPI_connect();
-      PushActiveSnapshot(GetTransactionSnapshot());
-      pgstat_report_activity(STATE_RUNNING, buf.data);
+static XLogRecPtr activity_lsn = InvalidXLogRecPtr;     /* after our WAL */
+static TimestampTz activity_time = 0;   /* after our last commit */
+static bool skipped = false;    /* the previous tick was skipped for WAL */
 
-      rc = SPI_execute(buf.data, false, 0);
-      if (rc != SPI_OK_UPDATE) {
-        ereport(FATAL, (errmsg("%s: cannot update timestamp: error code %d",
-                               MyBgworkerEntry->bgw_name, rc)));
-      }
+static bool
+primary_busy(void)
+{
+  TimestampTz commit_ts;
+  TransactionId xid;
 
-      SPI_finish();
-      PopActiveSnapshot();
-      CommitTransactionCommand();
-      pgstat_report_activity(STATE_IDLE, NULL);
-    }
+  if (track_commit_timestamp) {
+    xid = GetLatestCommitTsData(&commit_ts, NULL);
+    return TransactionIdIsValid(xid) && commit_ts > activity_time;
   }
 
-  proc_exit(0);
+  skipped = !skipped && !XLogRecPtrIsInvalid(activity_lsn) &&
+    GetXLogInsertRecPtr() > activity_lsn;
+  return skipped;
 }
 
+/* note where our own writes of this tick ended */
+static void
+primary_quiet(void)
+{
+  activity_lsn = GetXLogInsertRecPtr();
+  activity_time = GetCurrentTimestamp();
+}
 
 /*
- * Entrypoint of this module.
+ * Log the round trip time to each standby. The walsender measures its
+ * write_lag as the time from flushing WAL locally to the standby
+ * confirming it has written it, which is the round trip plus a little
+ * processing and so errs on the safe side. An idle standby has no
+ * write_lag; it is listed with a round trip of -1, so it still knows it
+ * is connected to the primary.
  */
-void
-_PG_init(void)
+static void
+report_rtt(void)
 {
-  BackgroundWorker worker;
+  int rc;
+  uint64 i;
+  xl_streaming_lag_rtt_entry *entries;
+  int n = 0;
 
-  /* get GUC settings, if available */
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  SPI_connect();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, RTT_QUERY);
 
-  DefineCustomStringVariable(
-                             "streaming_lag.database",
-                             "Database used for streaming_lag",
-                             "Database used to generate WAL timestamps (default: postgres).",
-                             &guc_database,
-                             "postgres",
-                             PGC_POSTMASTER,
-                             0,
-                             NULL,
-                             NULL,
-                             NULL
-                             );
+  rc = SPI_execute(RTT_QUERY, true, 0);
+  if (rc != SPI_OK_SELECT) {
+    ereport(ERROR, (errmsg("%s: cannot read pg_stat_replication: error code %d",
+                           MyBgworkerEntry->bgw_name, rc)));
+  }
 
-  if (!process_shared_preload_libraries_in_progress) return;
-  
-  DefineCustomStringVariable(
-                             "streaming_lag.schema",
-                             "Schema used for streaming_lag",
-                             "Schema used to generate WAL timestamps (default: public).",
-                             &guc_schema,
-                             "public",
+  entries = (xl_streaming_lag_rtt_entry *)
+    palloc(sizeof(xl_streaming_lag_rtt_entry) * Max(SPI_processed, 1));
+
+  for (i = 0; i < SPI_processed; i++) {
+    HeapTuple tuple = SPI_tuptable->vals[i];
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    bool isnull;
+    int64 rtt = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+    if (isnull) rtt = -1;
+    entries[n].node = sl_clock_node_hash(SPI_getvalue(tuple, tupdesc, 1));
+    entries[n].rtt = (int32) Min(rtt, PG_INT32_MAX);
+    n++;
+  }
+
+  if (n > 0) sl_xlog_rtt(entries, n);
+
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/* returns true if the round trip times are due to be logged again */
+static bool
+rtt_due(void)
+{
+  TimestampTz now = GetCurrentTimestamp();
+
+  if (!TimestampDifferenceExceeds(last_rtt, now, RTT_INTERVAL_MS)) return false;
+
+  last_rtt = now;
+  return true;
+}
+
+/*
+ * Workers per database
+ *
+ * The main worker starts a dynamic background worker for every other
+ * database in streaming_lag.databases, stops those no longer listed
+ * after a reload and restarts those which exited, at most every
+ * DB_WORKER_RESTART_MS. The workers exit when the main worker is gone,
+ * so a restarted main worker does not find stray ones.
+ */
+
+#define DB_WORKER_RESTART_MS 10000
+
+typedef struct DbWorker
+{
+  char        name[NAMEDATALEN];
+  BackgroundWorkerHandle *handle;       /* NULL if the slot is free */
+  TimestampTz started;
+} DbWorker;
+
+static DbWorker *db_workers = NULL;
+
+static void
+start_db_worker(DbWorker *w)
+{
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "streaming_lag");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "streaming_lag_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "streaming_lag %s", w->name);
+  snprintf(worker.bgw_type, BGW_MAXLEN, "streaming_lag");
+  strlcpy(worker.bgw_extra, w->name, BGW_EXTRALEN);
+  worker.bgw_main_arg = UInt32GetDatum(launcher);
+  worker.bgw_notify_pid = MyProcPid;
+
+  w->started = GetCurrentTimestamp();
+  if (w->handle) pfree(w->handle);
+  w->handle = NULL;
+
+  if (!RegisterDynamicBackgroundWorker(&worker, &w->handle)) {
+    ereport(LOG, (errmsg("%s: cannot start worker for database \"%s\"",
+                         MyBgworkerEntry->bgw_name, w->name),
+                  errhint("Consider increasing max_worker_processes.")));
+  }
+}
+
+/* is name in the list of names? */
+static bool
+name_listed(List *names, const char *name)
+{
+  ListCell *lc;
+
+  foreach(lc, names) {
+    if (strcmp((char *) lfirst(lc), name) == 0) return true;
+  }
+  return false;
+}
+
+/*
+ * Bring the running workers in line with streaming_lag.databases
+ */
+static void
+sync_db_workers(void)
+{
+  MemoryContext oldcontext;
+  char *rawstring;
+  List *names = NIL;
+  ListCell *lc;
+  int nslots = Max(guc_max_databases - 1, 0);
+  int i;
+
+  if (!is_main) return;
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  if (db_workers == NULL) db_workers = palloc0(sizeof(DbWorker) * Max(nslots, 1));
+  MemoryContextSwitchTo(oldcontext);
+
+  rawstring = pstrdup(guc_databases);
+  if (!SplitIdentifierString(rawstring, ',', &names)) {
+    ereport(LOG, (errmsg("%s: invalid list syntax in streaming_lag.databases",
+                         MyBgworkerEntry->bgw_name)));
+    names = NIL;
+  }
+
+  /* stop the workers of databases no longer listed */
+  for (i = 0; i < nslots; i++) {
+    DbWorker *w = &db_workers[i];
+
+    if (w->name[0] == '\0' || name_listed(names, w->name)) continue;
+
+    if (w->handle) {
+      TerminateBackgroundWorker(w->handle);
+      pfree(w->handle);
+    }
+    memset(w, 0, sizeof(*w));
+  }
+
+  /* start the missing ones */
+  foreach(lc, names) {
+    char *name = (char *) lfirst(lc);
+    DbWorker *free_slot = NULL;
+    bool found = false;
+
+    if (strcmp(name, guc_database) == 0) continue;
+
+    for (i = 0; i < nslots; i++) {
+      if (strcmp(db_workers[i].name, name) == 0) found = true;
+      else if (db_workers[i].name[0] == '\0' && free_slot == NULL)
+        free_slot = &db_workers[i];
+    }
+    if (found) continue;
+
+    if (free_slot == NULL) {
+      ereport(LOG, (errmsg("%s: no worker slot left for database \"%s\"",
+                           MyBgworkerEntry->bgw_name, name),
+                    errhint("Increase streaming_lag.max_databases.")));
+      continue;
+    }
+
+    strlcpy(free_slot->name, name, NAMEDATALEN);
+    start_db_worker(free_slot);
+  }
+
+  list_free(names);
+  pfree(rawstring);
+}
+
+/*
+ * Restart the workers which exited, e.g. because the extension is
+ * missing in their database
+ */
+static void
+check_db_workers(void)
+{
+  TimestampTz now = GetCurrentTimestamp();
+  int nslots = Max(guc_max_databases - 1, 0);
+  int i;
+
+  if (!is_main || db_workers == NULL) return;
+
+  for (i = 0; i < nslots; i++) {
+    DbWorker *w = &db_workers[i];
+    pid_t pid;
+
+    if (w->name[0] == '\0') continue;
+    if (w->handle && GetBackgroundWorkerPid(w->handle, &pid) != BGWH_STOPPED)
+      continue;
+    if (!TimestampDifferenceExceeds(w->started, now, DB_WORKER_RESTART_MS))
+      continue;
+
+    start_db_worker(w);
+  }
+}
+
+/* in a worker for a database, is the main worker still there? */
+static bool
+launcher_alive(void)
+{
+  return PostmasterIsAlive() && sl_launcher_generation() == launcher;
+}
+
+/* as the main worker exits, tell the workers it started */
+static void
+launcher_exit(int code, Datum arg)
+{
+  (void) sl_launcher_bump();
+}
+
+/*
+ * Error recovery
+ *
+ * An error while initializing or in a tick is logged and its
+ * transaction aborted. Then the worker waits RETRY_MIN_MS, doubled
+ * after every further failure up to RETRY_MAX_MS, and carries on where
+ * it was, instead of exiting and waiting for the postmaster to start it
+ * again.
+ */
+
+#define RETRY_MIN_MS 100
+#define RETRY_MAX_MS 10000
+
+static int retry_delay = 0;     /* milliseconds, 0 after a success */
+
+static void
+recover(MemoryContext context)
+{
+  MemoryContextSwitchTo(context);
+
+  HOLD_INTERRUPTS();
+  EmitErrorReport();
+  AbortCurrentTransaction();
+  FlushErrorState();
+  RESUME_INTERRUPTS();
+
+  pgstat_report_activity(STATE_IDLE, NULL);
+
+  /* the plans and the heartbeat TID may be what failed */
+  forget_update_plan();
+  ItemPointerSetInvalid(&data_tid);
+
+  retry_delay = retry_delay > 0 ? Min(retry_delay * 2, RETRY_MAX_MS)
+                                : RETRY_MIN_MS;
+  ereport(LOG, (errmsg("%s: retrying in %d ms",
+                       MyBgworkerEntry->bgw_name, retry_delay)));
+
+  (void) WaitLatch(MyLatch,
+                   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                   retry_delay,
+                   PG_WAIT_EXTENSION);
+  ResetLatch(MyLatch);
+}
+
+/*
+ * Done once per connection, after initialize_objects
+ */
+static void
+configure_session(void)
+{
+  int rc;
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  SPI_connect();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, "SET synchronous_commit TO off");
+
+  rc = SPI_execute("SET synchronous_commit TO off", false, 0);
+  if (rc != SPI_OK_UTILITY) {
+    ereport(ERROR, (errmsg("%s: cannot SET synchronous_commit TO off: error code %d",
+                           MyBgworkerEntry->bgw_name, rc)));
+  }
+
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * With hot standby the main worker is started as soon as a standby is
+ * consistent, and waits here until it is promoted. So the first
+ * heartbeat of a new primary follows the promotion within
+ * PROMOTION_POLL_MS, not whenever the postmaster gets round to starting
+ * the worker. Meanwhile it samples replay stalls, see sl_stall.c.
+ */
+
+#define PROMOTION_POLL_MS 10
+
+static void
+wait_for_promotion(void)
+{
+  if (!RecoveryInProgress()) return;
+
+  log_info("waiting for promotion");
+
+  while (RecoveryInProgress()) {
+    (void) WaitLatch(MyLatch,
+                     WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                     PROMOTION_POLL_MS,
+                     PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    if (got_sigterm) proc_exit(0);
+    if (got_sighup) {
+      got_sighup = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    sl_stall_sample();
+  }
+
+  sl_stall_stop();
+  log_info("promoted, starting heartbeats");
+}
+
+void
+streaming_lag_main(Datum main_arg)
+{
+  StringInfoData buf;
+  int rc;
+  MemoryContext loop_context;
+  volatile bool initialized = false;
+
+  pqsignal(SIGTERM, sigterm);
+  pqsignal(SIGHUP,  sighup);
+
+  /* We're now ready to receive signals */
+  BackgroundWorkerUnblockSignals();
+
+  /* workers for streaming_lag.databases get the name in bgw_extra */
+  if (MyBgworkerEntry->bgw_extra[0] != '\0') {
+    is_main = false;
+    launcher = DatumGetUInt32(main_arg);
+  } else {
+    launcher = sl_launcher_bump();
+    before_shmem_exit(launcher_exit, (Datum) 0);
+  }
+
+  /* Connect to database */
+  BackgroundWorkerInitializeConnection(is_main ? guc_database
+                                       : MyBgworkerEntry->bgw_extra,
+                                       NULL, 0);
+
+  loop_context = CurrentMemoryContext;
+
+  wait_for_promotion();
+
+  /* Verify expected objects exist */
+  while (!initialized) {
+    if (got_sigterm) proc_exit(0);
+
+    PG_TRY();
+    {
+      initialize_objects();
+      configure_session();
+      initialized = true;
+    }
+    PG_CATCH();
+    {
+      recover(loop_context);
+    }
+    PG_END_TRY();
+  }
+  retry_delay = 0;
+
+  initStringInfo(&buf);
+  appendStringInfo(&buf,
+                   "UPDATE %s.streaming_lag_data SET tstmp=now()",
+                   guc_schema);
+
+  logical_cmd = psprintf("INSERT INTO %s.streaming_lag_logical (origin, tstmp)"
+                         " VALUES (%s, now())"
+                         " ON CONFLICT (origin) DO UPDATE SET tstmp = now()",
+                         guc_schema, quote_literal_cstr(origin_name()));
+
+  schedule_reset();
+  sync_db_workers();
+
+  /* the first heartbeat right away, e.g. just after a promotion */
+  if (next_tick != 0) next_tick = GetCurrentTimestamp();
+
+  while (!got_sigterm) {
+    long timeout = schedule_timeout();
+
+    /* poll for the confirmation of a pending sync probe */
+    if (!XLogRecPtrIsInvalid(sync_lsn)) {
+      long poll = probe_sync_poll();
+
+      if (timeout < 0 || timeout > poll) timeout = poll;
+    }
+
+    rc = WaitLatch(MyLatch,
+                   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+                   (timeout >= 0 ? WL_TIMEOUT : 0),
+                   timeout,
+                   PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    /* emergency bailout if postmaster has died */
+    if (rc & WL_POSTMASTER_DEATH) proc_exit(1);
+
+    if (got_sighup) {
+      got_sighup = false;
+      ProcessConfigFile(PGC_SIGHUP);
+      forget_update_plan();
+      if (guc_precision != configured_precision) schedule_reset();
+      sync_db_workers();
+    }
+
+    probe_sync_check();
+
+    if (!is_main && !launcher_alive()) {
+      log_info("main worker gone, exiting");
+      proc_exit(0);
+    }
+
+    if (schedule_due()) {
+      PG_TRY();
+      {
+        if (guc_skip_when_busy && primary_busy()) {
+          ereport(DEBUG1, (errmsg("%s: primary busy, heartbeat skipped",
+                                  MyBgworkerEntry->bgw_name)));
+        } else {
+          heartbeat(buf.data);
+        }
+        primary_quiet();
+        if (is_main) {
+          if (rtt_due()) report_rtt();
+          adapt_precision();
+          check_db_workers();
+        }
+        retry_delay = 0;
+      }
+      PG_CATCH();
+      {
+        recover(loop_context);
+      }
+      PG_END_TRY();
+    }
+  }
+
+  proc_exit(0);
+}
+
+
+/*
+ * Entrypoint of this module.
+ */
+void
+_PG_init(void)
+{
+  BackgroundWorker worker;
+
+  /* get GUC settings, if available */
+
+  DefineCustomStringVariable(
+                             "streaming_lag.database",
+                             "Database used for streaming_lag",
+                             "Database used to generate WAL timestamps (default: postgres).",
+                             &guc_database,
+                             "postgres",
+                             PGC_POSTMASTER,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL
+                             );
+
+  if (!process_shared_preload_libraries_in_progress) return;
+  
+  DefineCustomStringVariable("streaming_lag.databases",
+                             "Further databases to write heartbeats in.",
+                             "Comma separated list. Every database gets a "
+                             "worker of its own.",
+                             &guc_databases,
+                             "",
+                             PGC_SIGHUP,
+                             GUC_LIST_INPUT,
+                             NULL,
+                             NULL,
+                             NULL);
+
+  DefineCustomIntVariable("streaming_lag.max_databases",
+                          "Number of databases heartbeats are tracked for.",
+                          NULL,
+                          &guc_max_databases,
+                          8,
+                          1,
+                          1024,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable(
+                             "streaming_lag.schema",
+                             "Schema used for streaming_lag",
+                             "Schema used to generate WAL timestamps (default: public).",
+                             &guc_schema,
+                             "public",
                              PGC_POSTMASTER,
                              0,
                              NULL,
@@ -320,16 +1404,311 @@ _PG_init(void)
                           NULL,
                           NULL);
 
+  DefineCustomIntVariable("streaming_lag.min_precision",
+                          "Shortest adaptive heartbeat interval (in milliseconds).",
+                          "If set below streaming_lag.precision, the interval "
+                          "shrinks towards it while the standbys' lag rises "
+                          "or WAL comes in bursts. 0 keeps the interval fixed.",
+                          &guc_min_precision,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomEnumVariable("streaming_lag.mode",
+                           "How the heartbeat is written.",
+                           "'table' updates streaming_lag_data, 'heap' does so "
+                           "without the executor, 'wal' emits a WAL-only record "
+                           "and leaves the table alone.",
+                           &guc_mode,
+                           SL_MODE_TABLE,
+                           mode_options,
+                           PGC_SIGHUP,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomBoolVariable("streaming_lag.skip_when_busy",
+                           "Skip heartbeats while other transactions write.",
+                           "A heartbeat is only written if the primary was "
+                           "quiet during the preceding interval.",
+                           &guc_skip_when_busy,
+                           false,
+                           PGC_SIGHUP,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomBoolVariable("streaming_lag.logical",
+                           "Also write heartbeats for logical replication.",
+                           "In table and heap mode every heartbeat also "
+                           "updates the row of this server in "
+                           "streaming_lag_logical.",
+                           &guc_logical,
+                           false,
+                           PGC_SIGHUP,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomIntVariable("streaming_lag.flush_probe_interval",
+                          "Every how many heartbeats the WAL flush is timed.",
+                          "The time it takes the heartbeat record to be "
+                          "flushed goes into the flush histogram. "
+                          "0 turns the probe off.",
+                          &guc_flush_probe,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.sync_probe_interval",
+                          "Every how many heartbeats synchronous replication is timed.",
+                          "The time until the synchronous standbys confirm "
+                          "the heartbeat goes into the sync histogram. "
+                          "0 turns the probe off.",
+                          &guc_sync_probe,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomEnumVariable("streaming_lag.sync_probe_level",
+                           "Confirmation the sync probe waits for.",
+                           "As synchronous_commit: remote_write, on or "
+                           "remote_apply.",
+                           &guc_sync_probe_level,
+                           SYNC_REP_WAIT_APPLY,
+                           sync_probe_options,
+                           PGC_SIGHUP,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomIntVariable("streaming_lag.lsn_map_size",
+                          "Number of LSN to timestamp anchors kept per source.",
+                          "The map is used to interpolate the lag between "
+                          "heartbeats.",
+                          &guc_lsn_map_size,
+                          4096,
+                          0,
+                          INT_MAX / 64,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.history_size",
+                          "Number of lag samples kept on a replica.",
+                          "A sample is taken at every replayed heartbeat.",
+                          &guc_history_size,
+                          8192,
+                          0,
+                          INT_MAX / 16,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.lag_file_size",
+                          "Size of the file every replayed heartbeat is logged to.",
+                          "The file is a ring in the data directory. "
+                          "0 turns it off.",
+                          &guc_lag_file_size,
+                          0,
+                          0,
+                          INT_MAX / 1024,
+                          PGC_POSTMASTER,
+                          GUC_UNIT_KB,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.stall_threshold",
+                          "Lag above which a replica samples what replay is doing.",
+                          "Replayed records per resource manager and the wait "
+                          "events of the startup process are accounted to "
+                          "the stall. 0 turns it off.",
+                          &guc_stall_threshold,
+                          1000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.rollup_seconds",
+                          "Number of one second lag buckets kept on a replica.",
+                          NULL,
+                          &guc_rollup_seconds,
+                          3600,
+                          0,
+                          INT_MAX / 256,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.rollup_minutes",
+                          "Number of one minute lag buckets kept on a replica.",
+                          NULL,
+                          &guc_rollup_minutes,
+                          1440,
+                          0,
+                          INT_MAX / 256,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.rollup_hours",
+                          "Number of one hour lag buckets kept on a replica.",
+                          NULL,
+                          &guc_rollup_hours,
+                          720,
+                          0,
+                          INT_MAX / 256,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable("streaming_lag.node_name",
+                             "Application name this standby connects with.",
+                             "Must match application_name in primary_conninfo "
+                             "if it is set there. Defaults to cluster_name, "
+                             "or 'walreceiver' if that is empty.",
+                             &guc_node_name,
+                             "",
+                             PGC_SIGHUP,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+  DefineCustomBoolVariable("streaming_lag.clock_correction",
+                           "Correct the lag for the clock offset to the primary.",
+                           "The offset is estimated from the send and receipt "
+                           "times of the replication messages.",
+                           &guc_clock_correction,
+                           false,
+                           PGC_SIGHUP,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomIntVariable("streaming_lag.max_staleness",
+                          "Largest lag at which a replica runs queries.",
+                          "0 turns the check off.",
+                          &guc_max_staleness,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.metrics_port",
+                          "TCP port of the metrics endpoint.",
+                          "0 (the default) does not start the metrics worker.",
+                          &guc_metrics_port,
+                          0,
+                          0,
+                          65535,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable("streaming_lag.metrics_address",
+                             "IPv4 address the metrics endpoint listens on.",
+                             NULL,
+                             &guc_metrics_address,
+                             "127.0.0.1",
+                             PGC_POSTMASTER,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+  DefineCustomIntVariable("streaming_lag.health_port",
+                          "TCP port of the health check responder.",
+                          "0 (the default) turns it off.",
+                          &guc_health_port,
+                          0,
+                          0,
+                          65535,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("streaming_lag.health_max_lag",
+                          "Largest lag at which health checks report up.",
+                          NULL,
+                          &guc_health_max_lag,
+                          1000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  MarkGUCPrefixReserved("streaming_lag");
+
+  /*
+   * shared state, the WAL resource manager of the heartbeat records and
+   * the staleness guard
+   */
+  sl_shmem_init();
+  sl_xlog_init();
+  sl_guard_init();
+
   /* register the worker processes */
+  memset(&worker, 0, sizeof(worker));
   worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-  worker.bgw_main = my_main;
+  worker.bgw_start_time = BgWorkerStart_ConsistentState;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "streaming_lag");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "streaming_lag_main");
 
   worker.bgw_restart_time = 1;
   worker.bgw_main_arg = (Datum) 0;
 
   /* this value is shown in the process list */
   snprintf(worker.bgw_name, BGW_MAXLEN, "streaming_lag");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "streaming_lag");
 
   RegisterBackgroundWorker(&worker);
+
+  sl_metrics_init();
 }
@@ -22,7 +22,7 @@ set timefmt z "%H:%M:%S"
 set zdata 
 set timefmt y "%H:%M:%S"
 set ydata 
-set timefmt x "%H:%M:%S"
+set timefmt x "%Y-%m-%dT%H:%M:%S"
 set xdata time
 set timefmt cb "%H:%M:%S"
 set timefmt y2 "%H:%M:%S"
@@ -35,7 +35,7 @@ set style rectangle back fc  lt -3 fillstyle   solid 1.00 border lt -1
 set style circle radius graph 0.02, first 0, 0 
 set style ellipse size graph 0.05, 0.03, first 0 angle 0 units xy
 set dummy x,y
-set format x "%H:%M:%S"
+set format x "%m-%d\n%H:%M:%S"
 set format y "% g"
 set format x2 "% g"
 set format y2 "% g"
@@ -0,0 +1,273 @@
+/*
+ * streaming_lag.h
+ *
+ * Declarations shared between the modules of the streaming_lag
+ * extension
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#ifndef STREAMING_LAG_H
+#define STREAMING_LAG_H
+
+#include "access/rmgr.h"
+#include "access/xlogdefs.h"
+#include "access/xlogreader.h"
+#include "datatype/timestamp.h"
+#include "fmgr.h"
+#include "storage/condition_variable.h"
+#include "storage/lwlock.h"
+#include "utils/tuplestore.h"
+
+/*
+ * Resource manager used for the heartbeat WAL records. RM_EXPERIMENTAL_ID
+ * is fine for a single installation; if you run other extensions with
+ * custom WAL resource managers, reserve a distinct ID on
+ * https://wiki.postgresql.org/wiki/CustomWALResourceManagers
+ */
+#define RM_STREAMING_LAG_ID   RM_EXPERIMENTAL_ID
+#define STREAMING_LAG_RM_NAME "streaming_lag"
+
+/* info bits of the heartbeat resource manager */
+#define XLOG_STREAMING_LAG_HEARTBEAT 0x00
+#define XLOG_STREAMING_LAG_RTT       0x10
+#define XLOG_STREAMING_LAG_LOAD      0x20
+
+typedef struct xl_streaming_lag_heartbeat
+{
+  TimestampTz tstmp;            /* primary's clock when the record was made */
+  Oid         dbid;             /* database of the worker writing it */
+  TimeLineID  tli;              /* timeline it was written on */
+  uint8       flags;
+} xl_streaming_lag_heartbeat;
+
+/* without the trailing padding, which is never initialized */
+#define SizeOfStreamingLagHeartbeat \
+  (offsetof(xl_streaming_lag_heartbeat, flags) + sizeof(uint8))
+
+/* written by the worker for streaming_lag.database */
+#define XLH_HEARTBEAT_MAIN 0x01
+
+/* round trip times from the primary to its standbys */
+typedef struct xl_streaming_lag_rtt_entry
+{
+  uint32      node;             /* sl_clock_node_hash(application_name) */
+  int32       rtt;              /* microseconds, -1 if unknown */
+} xl_streaming_lag_rtt_entry;
+
+typedef struct xl_streaming_lag_rtt
+{
+  int32       nentries;
+  xl_streaming_lag_rtt_entry entries[FLEXIBLE_ARRAY_MEMBER];
+} xl_streaming_lag_rtt;
+
+#define SizeOfStreamingLagRtt offsetof(xl_streaming_lag_rtt, entries)
+
+/* filler written by streaming_lag_generate_load(), ignored by replay */
+typedef struct xl_streaming_lag_load
+{
+  int32       len;              /* bytes of data */
+  char        data[FLEXIBLE_ARRAY_MEMBER];
+} xl_streaming_lag_load;
+
+#define SizeOfStreamingLagLoad offsetof(xl_streaming_lag_load, data)
+
+/* values of streaming_lag.mode */
+typedef enum StreamingLagMode
+{
+  SL_MODE_TABLE,                /* UPDATE streaming_lag_data */
+  SL_MODE_HEAP,                 /* same, bypassing SPI and the executor */
+  SL_MODE_WAL                   /* emit a WAL-only heartbeat record */
+} StreamingLagMode;
+
+/* sources of the anchors of the LSN map */
+#define SL_ANCHOR_HEARTBEAT 0
+#define SL_ANCHOR_UPSTREAM  1
+#define SL_ANCHOR_NSOURCES  2
+
+/* a sample of the lag history */
+typedef struct SlSample
+{
+  TimestampTz sample_time;      /* local clock */
+  int64       lag;              /* microseconds */
+} SlSample;
+
+/* summary of a window of the lag history, in microseconds */
+typedef struct SlLagStats
+{
+  int64       samples;
+  int64       min;
+  int64       avg;
+  int64       p50;
+  int64       p95;
+  int64       p99;
+  int64       max;
+} SlLagStats;
+
+/* statistics of the heartbeat worker */
+typedef struct SlWorkerStats
+{
+  uint64      ticks;
+  uint64      missed_ticks;     /* coalesced into a later tick */
+  uint64      jitter_last;      /* microseconds behind schedule */
+  uint64      jitter_max;
+  uint64      heartbeats;       /* ticks that wrote a heartbeat */
+  uint64      tick_time_last;   /* microseconds */
+  uint64      tick_time_max;
+  uint64      tick_time_total;
+  uint64      exec_time_total;  /* of the UPDATE */
+  uint64      commit_time_total;
+  uint64      wal_bytes;
+} SlWorkerStats;
+
+/* histograms of sl_histogram.c */
+#define SL_HIST_LAG         0
+#define SL_HIST_UPSTREAM    1
+#define SL_HIST_LINK        2
+#define SL_HIST_FLUSH       3
+#define SL_HIST_SYNC        4
+#define SL_NHISTOGRAMS      5
+
+/* LWLocks of the streaming_lag tranche */
+#define SL_LWLOCK_HISTORY   0
+#define SL_LWLOCK_ROLLUP    1
+#define SL_LWLOCK_DATABASES 2
+#define SL_LWLOCK_LOGICAL   3
+#define SL_LWLOCK_STALLS    4
+#define SL_NUM_LWLOCKS      5
+
+/* GUC variables shared between modules */
+extern int guc_lsn_map_size;
+extern int guc_history_size;
+extern int guc_rollup_seconds;
+extern int guc_rollup_minutes;
+extern int guc_rollup_hours;
+extern char *guc_node_name;
+extern bool guc_clock_correction;
+extern bool guc_skip_when_busy;
+extern int guc_max_staleness;
+extern int guc_metrics_port;
+extern char *guc_metrics_address;
+extern int guc_health_port;
+extern int guc_health_max_lag;
+extern int guc_max_databases;
+extern int guc_lag_file_size;
+extern int guc_stall_threshold;
+
+/* sl_shmem.c */
+extern void sl_shmem_init(void);
+extern void sl_state_set(TimestampTz tstmp, XLogRecPtr lsn, TimeLineID tli);
+extern bool sl_state_get(TimestampTz *tstmp, XLogRecPtr *lsn,
+                         TimeLineID *tli);
+extern ConditionVariable *sl_heartbeat_cv(void);
+extern void sl_redo_done(XLogReaderState *record);
+extern XLogRecPtr sl_wait_lsn_watch(XLogRecPtr lsn);
+extern TimestampTz sl_xact_time(void);
+extern bool sl_primary_time(TimestampTz *tstmp);
+extern uint32 sl_launcher_bump(void);
+extern uint32 sl_launcher_generation(void);
+extern void sl_stats_tick(int64 jitter, int64 missed);
+extern void sl_stats_heartbeat(int64 tick_time, int64 exec_time,
+                               int64 commit_time, uint64 wal_bytes);
+extern void sl_stats_get(SlWorkerStats *stats);
+extern LWLock *sl_lwlock(int id);
+extern Interval *sl_make_interval(int64 usec);
+extern int64 sl_interval_usec(const Interval *interval);
+extern Tuplestorestate *sl_srf_begin(FunctionCallInfo fcinfo,
+                                     TupleDesc *tupdesc);
+
+/* sl_history.c */
+extern Size sl_history_shmem_size(void);
+extern void sl_history_shmem_startup(void);
+extern void sl_history_add(TimestampTz sample_time, int64 lag);
+extern int sl_history_window(TimestampTz since, SlSample **samples);
+extern bool sl_history_stats(TimestampTz since, SlLagStats *stats);
+
+/* sl_rate.c */
+extern Size sl_rate_shmem_size(void);
+extern void sl_rate_shmem_startup(void);
+extern void sl_rate_add(TimestampTz now, TimestampTz tstmp, XLogRecPtr lsn);
+extern bool sl_rate_get(double *bytes_rate, double *speed);
+extern bool sl_rate_eta(int64 lag, int64 *eta);
+
+/* sl_rollup.c */
+extern Size sl_rollup_shmem_size(void);
+extern void sl_rollup_shmem_startup(void);
+extern void sl_rollup_add(TimestampTz sample_time, int64 lag);
+
+/* sl_clock.c */
+extern Size sl_clock_shmem_size(void);
+extern void sl_clock_shmem_startup(void);
+extern uint32 sl_clock_node_hash(const char *name);
+extern const char *sl_clock_given_name(void);
+extern const char *sl_clock_node_name(void);
+extern void sl_clock_sample(void);
+extern void sl_clock_set_rtt(const xl_streaming_lag_rtt *xlrec);
+extern bool sl_clock_direct(void);
+extern bool sl_clock_offset(int64 *offset, int64 *error, int *samples);
+extern TimestampTz sl_clock_correct(TimestampTz tstmp);
+
+/* sl_database.c */
+extern Size sl_database_shmem_size(void);
+extern void sl_database_shmem_startup(void);
+extern void sl_database_add(Oid dbid, TimestampTz tstmp, XLogRecPtr lsn,
+                            TimestampTz now);
+
+/* sl_hops.c */
+extern Size sl_hops_shmem_size(void);
+extern void sl_hops_shmem_startup(void);
+extern void sl_hops_add(TimestampTz tstmp, XLogRecPtr lsn, TimestampTz now);
+
+/* sl_guard.c */
+extern void sl_guard_init(void);
+
+/* sl_histogram.c */
+extern Size sl_histogram_shmem_size(void);
+extern void sl_histogram_shmem_startup(void);
+extern void sl_histogram_record(int histogram, int64 value);
+extern bool sl_histogram_percentile(int histogram, double p, int64 *value);
+
+/* sl_lagfile.c */
+extern void sl_lagfile_add(TimestampTz sample_time, int64 lag,
+                           XLogRecPtr lsn);
+
+/* sl_logical.c */
+extern Size sl_logical_shmem_size(void);
+extern void sl_logical_shmem_startup(void);
+
+/* sl_lsnmap.c */
+extern Size sl_lsnmap_shmem_size(void);
+extern void sl_lsnmap_shmem_startup(void);
+extern void sl_lsnmap_add(int source, XLogRecPtr lsn, TimestampTz tstmp,
+                          TimeLineID tli);
+extern void sl_lsnmap_sample_upstream(void);
+extern bool sl_lsnmap_lookup(XLogRecPtr lsn, TimestampTz *tstmp);
+extern bool sl_lsnmap_lookup_source(int source, XLogRecPtr lsn,
+                                    TimestampTz *tstmp);
+extern bool sl_lsnmap_lag_components(int64 *network, int64 *apply,
+                                     int64 *total);
+extern bool sl_lsnmap_lag(int64 *lag);
+extern bool sl_lsnmap_lsn_lag(XLogRecPtr lsn, int64 *lag);
+
+/* sl_metrics.c */
+extern void sl_metrics_init(void);
+
+/* sl_stall.c */
+extern Size sl_stall_shmem_size(void);
+extern void sl_stall_shmem_startup(void);
+extern void sl_stall_install(void);
+extern void sl_stall_uninstall(void);
+extern void sl_stall_sample(void);
+extern void sl_stall_stop(void);
+
+/* sl_xlog.c */
+extern void sl_xlog_init(void);
+extern XLogRecPtr sl_xlog_heartbeat(TimestampTz tstmp, bool main);
+extern XLogRecPtr sl_xlog_rtt(const xl_streaming_lag_rtt_entry *entries,
+                              int nentries);
+extern XLogRecPtr sl_xlog_load(const char *data, int len);
+
+#endif /* STREAMING_LAG_H */
@@ -0,0 +1,137 @@
+/*
+ * streaming_lag_dump.c
+ *
+ * Print the lag file of a replica, oldest record first, as CSV or as
+ * input for streaming_lag.gp. Reads the file only, the server need not
+ * run. If it does, the records it overwrites while they are read are
+ * left out.
+ *
+ *     streaming_lag_dump [-f csv|gnuplot] [FILE]
+ *
+ * FILE defaults to streaming_lag.ring in the current directory, which
+ * is where the server writes it in the data directory.
+ *
+ * Written by Torsten Förtsch <torsten.foertsch@gmx.net>
+ *
+ * Copyright 2014 Torsten Förtsch. This program is Free
+ * Software; see the README.md file for the license conditions.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sl_lagfile.h"
+
+/* seconds from the Unix epoch to the postgres epoch, 2000-01-01 */
+#define POSTGRES_EPOCH_UNIX 946684800
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "usage: %s [-f csv|gnuplot] [FILE]\n", progname);
+  exit(2);
+}
+
+static void
+print_record(const SlLagFileRecord *r, int csv)
+{
+  time_t secs = (time_t) (r->sample_time / 1000000) + POSTGRES_EPOCH_UNIX;
+  long usecs = (long) (r->sample_time % 1000000);
+  char buf[64];
+  struct tm tm;
+
+  if (usecs < 0) {
+    usecs += 1000000;
+    secs--;
+  }
+
+  if (csv) {
+    gmtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06ld+00,%.6f,%X/%X\n", buf, usecs, r->lag / 1000000.0,
+           (unsigned) (r->lsn >> 32), (unsigned) r->lsn);
+  } else {
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%06ld %.6f\n", buf, usecs, r->lag / 1000000.0);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *path = SL_LAGFILE_NAME;
+  int csv = 1;
+  SlLagFileHeader h;
+  SlLagFileRecord *records;
+  uint64_t first;
+  uint64_t last;
+  uint64_t i;
+  FILE *f;
+  int c;
+
+  while ((c = getopt(argc, argv, "f:")) != -1) {
+    switch (c) {
+    case 'f':
+      if (strcmp(optarg, "csv") == 0) csv = 1;
+      else if (strcmp(optarg, "gnuplot") == 0) csv = 0;
+      else usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1) usage(argv[0]);
+  if (optind == argc - 1) path = argv[optind];
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return 1;
+  }
+  /* nadded is read twice, from the file and not from a buffer */
+  setvbuf(f, NULL, _IONBF, 0);
+
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      h.magic != SL_LAGFILE_MAGIC || h.version != SL_LAGFILE_VERSION ||
+      h.record_size != sizeof(SlLagFileRecord) || h.capacity == 0) {
+    fprintf(stderr, "%s: not a lag file of version %d\n", path,
+            SL_LAGFILE_VERSION);
+    return 1;
+  }
+
+  records = malloc((size_t) h.capacity * sizeof(SlLagFileRecord));
+  if (records == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  if (fseek(f, SL_LAGFILE_HEADER, SEEK_SET) != 0 ||
+      fread(records, sizeof(SlLagFileRecord), h.capacity, f) != h.capacity) {
+    fprintf(stderr, "%s: file truncated\n", path);
+    return 1;
+  }
+
+  /* what the server added meanwhile may have overwritten some slots */
+  last = h.nadded;
+  if (fseek(f, 0, SEEK_SET) != 0 || fread(&h, sizeof(h), 1, f) != 1) {
+    fprintf(stderr, "%s: cannot read the header again\n", path);
+    return 1;
+  }
+  fclose(f);
+
+  first = last > h.capacity ? last - h.capacity : 0;
+
+  if (csv) printf("sample_time,lag_seconds,lsn\n");
+  for (i = first; i < last; i++) {
+    if (i + h.capacity <= h.nadded) continue;
+    print_record(&records[i % h.capacity], csv);
+  }
+
+  free(records);
+  return 0;
+}